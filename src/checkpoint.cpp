@@ -0,0 +1,329 @@
+#include "checkpoint.h"
+#include <iostream>
+#include <fstream>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// the wall time is checked once in this number of instructions
+const uint64_t CLOCK_POLL_INSTR = 0x10000;
+
+/*
+ * Append a big-endian field of 'bytes' size to the buffer
+ */
+void putField(std::string& buf, uint64_t value, uint8_t bytes){
+    for (uint8_t i = 0; i < bytes; i++)
+        buf.push_back((char)((value >> ((bytes - i - 1)*8)) & 0xff));
+}
+
+/*
+ * Read a big-endian field of 'bytes' size, the position is moved forward
+ */
+int getField(const uint8_t *data, size_t size, size_t& pos, uint64_t& value, uint8_t bytes){
+    if (pos + bytes > size)
+        return 1;
+    value = 0;
+    for (uint8_t i = 0; i < bytes; i++)
+        value = (value << 8) | data[pos + i];
+    pos += bytes;
+    return 0;
+}
+
+/*
+ * Write the buffer to a file next to the target one and rename it then,
+ * so a crash in the middle leaves the previous version of the file intact.
+ * The temporary file name is unique, the processes writing the same file don't share it
+ */
+int writeFileAtomically(const std::string& file, const std::string& buf, const std::string& what){
+    return writeFileAtomically(file, std::vector<const std::string*>(1, &buf), what);
+}
+
+int writeFileAtomically(const std::string& file, const std::vector<const std::string*>& parts, const std::string& what){
+    std::string tmp = file + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0){
+        simOut() << "Cannot create " << what << " file " << tmp << std::endl;
+        return 1;
+    }
+    // mkstemp creates the file for the owner only
+    fchmod(fd, 0644);
+    bool failed = false;
+    for (auto it = parts.begin(); it != parts.end() && !failed; ++it){
+        const std::string& buf = **it;
+        size_t written = 0;
+        while (written < buf.size()){
+            ssize_t ret = write(fd, buf.data() + written, buf.size() - written);
+            if (ret <= 0)
+                break;
+            written += ret;
+        }
+        failed = written != buf.size();
+    }
+    if (failed || fsync(fd)){
+        simOut() << "Cannot write " << what << " file " << tmp << std::endl;
+        close(fd);
+        unlink(tmp.c_str());
+        return 1;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), file.c_str())){
+        simOut() << "Cannot rename " << what << " file " << tmp << " to " << file << std::endl;
+        unlink(tmp.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Map the whole file read-only, the mapping is released with the last copy of the returned pointer.
+ * Files shorter than 4 bytes (a magic) are rejected
+ */
+std::shared_ptr<const void> mapFile(const std::string& file, size_t& size, const std::string& what){
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0){
+        simOut() << "Cannot open " << what << " file " << file << std::endl;
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < 4){
+        simOut() << "Wrong " << what << " file " << file << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    size_t len = st.st_size;
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        simOut() << "Cannot map " << what << " file " << file << std::endl;
+        return nullptr;
+    }
+    size = len;
+    return std::shared_ptr<const void>(map, [len](const void *p){ munmap(const_cast<void*>(p), len); });
+}
+
+/*
+ * Save the full simulator state. The file is written next to the target one and then renamed,
+ * so a crash in the middle leaves the previous checkpoint intact
+ */
+template <typename Addr, typename Word>
+int writeCheckpoint(const std::string& file, Core<Addr, Word>& core, Memory<Addr>& memory, Addr code_sz){
+    const uint8_t A = sizeof(Addr);
+    const uint8_t W = sizeof(Word);
+    std::string buf = "TCKP";
+    putField(buf, CHECKPOINT_VERSION, 2);
+    putField(buf, A, 1);
+    putField(buf, W, 1);
+    putField(buf, code_sz, A);
+    putField(buf, core.getInstrCount(), 8);
+    putField(buf, core.getCycles(), 8);
+    putField(buf, core.getIp(), A);
+    putField(buf, core.getFetchedInstr(), 4);
+    std::array<Word, 16> reg = core.getRegFile();
+    for (auto it = reg.begin(); it != reg.end(); ++it)
+        putField(buf, *it, W);
+
+    const std::vector<MemoryRange<Addr>*>& ranges = memory.getRanges();
+    putField(buf, ranges.size(), 2);
+    uint8_t record[PAGE_RECORD_SIZE];
+    for (auto it = ranges.begin(); it != ranges.end(); ++it){
+        std::string name = (*it)->getName();
+        putField(buf, name.size(), 1);
+        buf += name;
+        putField(buf, (*it)->getStart(), A);
+        putField(buf, (*it)->getEnd(), A);
+        putField(buf, (*it)->getMode(), 1);
+        std::vector<Addr> numbers = (*it)->getPageNumbers();
+        putField(buf, numbers.size(), 4);
+        for (auto page_it = numbers.begin(); page_it != numbers.end(); ++page_it){
+            putField(buf, *page_it, A);
+            (*it)->getPopulatedPage(*page_it)->store(record);
+            buf.append((const char*)record, PAGE_RECORD_SIZE);
+        }
+        IoRange<Addr>* io = dynamic_cast<IoRange<Addr>*>(*it);
+        if (io != nullptr){
+            std::vector<IoEvent<Addr> > events = io->getEvents();
+            putField(buf, events.size(), 4);
+            for (auto ev_it = events.begin(); ev_it != events.end(); ++ev_it){
+                putField(buf, ev_it->time, 8);
+                putField(buf, ev_it->addr, A);
+                putField(buf, ev_it->value, W);
+            }
+        }
+    }
+
+    return writeFileAtomically(file, buf, "checkpoint");
+}
+
+/*
+ * Read the address size from the checkpoint header
+ */
+int checkpointWidth(const std::string& file){
+    char header[8] = {0};
+    std::ifstream infile(file, std::ios::binary);
+    if (!infile.read(header, 8) || std::string(header, 4) != "TCKP")
+        return 0;
+    return (uint8_t)header[6];
+}
+
+/*
+ * Restore the simulator state from a checkpoint. The file is memory-mapped and the pages are
+ * only attached to the memory ranges, they are copied in on the first access to them
+ */
+template <typename Addr, typename Word>
+int readCheckpoint(const std::string& file, Core<Addr, Word>& core, Memory<Addr>& memory, Addr& code_sz){
+    const uint8_t A = sizeof(Addr);
+    const uint8_t W = sizeof(Word);
+    size_t size = 0;
+    // the mapping lives as long as there's a memory range with not faulted in pages
+    std::shared_ptr<const void> owner = mapFile(file, size, "checkpoint");
+    if (owner == nullptr)
+        return 1;
+    const uint8_t *data = (const uint8_t*)owner.get();
+
+    size_t pos = 4;
+    uint64_t field = 0;
+    int ret = 0;
+    if (std::string((const char*)data, 4) != "TCKP"){
+        simOut() << "Wrong checkpoint file format" << std::endl;
+        return 1;
+    }
+    ret += getField(data, size, pos, field, 2);
+    if (ret || field != CHECKPOINT_VERSION){
+        simOut() << "Unsupported checkpoint version " << std::dec << field << std::endl;
+        return 1;
+    }
+    uint64_t addr_size = 0;
+    uint64_t word_size = 0;
+    ret += getField(data, size, pos, addr_size, 1);
+    ret += getField(data, size, pos, word_size, 1);
+    if (ret || addr_size != A || word_size != W){
+        simOut() << "Checkpoint machine width mismatch" << std::endl;
+        return 1;
+    }
+
+    uint64_t icount = 0;
+    uint64_t cycles = 0;
+    uint64_t ip = 0;
+    uint64_t fetched_instr = 0;
+    std::array<Word, 16> reg;
+    ret += getField(data, size, pos, field, A);
+    code_sz = (Addr)field;
+    ret += getField(data, size, pos, icount, 8);
+    ret += getField(data, size, pos, cycles, 8);
+    ret += getField(data, size, pos, ip, A);
+    ret += getField(data, size, pos, fetched_instr, 4);
+    for (auto it = reg.begin(); it != reg.end(); ++it){
+        ret += getField(data, size, pos, field, W);
+        *it = (Word)field;
+    }
+    if (ret){
+        simOut() << "Core state cannot be read from the checkpoint" << std::endl;
+        return 1;
+    }
+    core.jump((Addr)ip);
+    core.restoreState((uint32_t)fetched_instr, icount, cycles, reg);
+
+    uint64_t ranges = 0;
+    ret += getField(data, size, pos, ranges, 2);
+    for (uint64_t i = 0; i < ranges && !ret; i++){
+        uint64_t name_len = 0;
+        uint64_t start = 0;
+        uint64_t end = 0;
+        uint64_t mode = 0;
+        uint64_t pages = 0;
+        ret += getField(data, size, pos, name_len, 1);
+        if (ret || pos + name_len > size){
+            ret = 1;
+            break;
+        }
+        std::string name((const char*)data + pos, name_len);
+        pos += name_len;
+        ret += getField(data, size, pos, start, A);
+        ret += getField(data, size, pos, end, A);
+        ret += getField(data, size, pos, mode, 1);
+        ret += getField(data, size, pos, pages, 4);
+        if (ret)
+            break;
+
+        MemoryRange<Addr>* range = newMemoryRange<Addr>((Addr)start, (Addr)end, (uint8_t)mode, name);
+        if (memory.registerMemoryRange(range)){
+            simOut() << "Cannot register memory range '" << name << "' from the checkpoint" << std::endl;
+            return 1;
+        }
+        for (uint64_t j = 0; j < pages; j++){
+            uint64_t page_no = 0;
+            ret += getField(data, size, pos, page_no, A);
+            if (ret || pos + PAGE_RECORD_SIZE > size){
+                ret = 1;
+                break;
+            }
+            range->attachLazyPage((Addr)page_no, data + pos, owner);
+            pos += PAGE_RECORD_SIZE;
+        }
+        IoRange<Addr>* io = dynamic_cast<IoRange<Addr>*>(range);
+        if (io != nullptr && !ret){
+            uint64_t events = 0;
+            ret += getField(data, size, pos, events, 4);
+            for (uint64_t j = 0; j < events && !ret; j++){
+                uint64_t time = 0;
+                uint64_t addr = 0;
+                uint64_t value = 0;
+                ret += getField(data, size, pos, time, 8);
+                ret += getField(data, size, pos, addr, A);
+                ret += getField(data, size, pos, value, W);
+                io->scheduleEvent(IoEvent<Addr>(time, (Addr)addr, (uint32_t)value, W));
+            }
+        }
+    }
+    if (ret || pos != size){
+        simOut() << "Memory state cannot be read from the checkpoint" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+Checkpointer::Checkpointer(const std::string& file, uint64_t every_instr, uint32_t every_sec, uint64_t icount) :
+    file(file),
+    every_instr(every_instr),
+    every_sec(every_sec),
+    next_check(std::numeric_limits<uint64_t>::max()),
+    next_instr(icount + every_instr),
+    last(std::chrono::steady_clock::now())
+{
+    if (enabled()){
+        next_check = every_instr ? next_instr : std::numeric_limits<uint64_t>::max();
+        if (every_sec && next_check > icount + CLOCK_POLL_INSTR)
+            next_check = icount + CLOCK_POLL_INSTR;
+    }
+}
+
+/*
+ * Check if a checkpoint is due and plan the next check
+ */
+bool Checkpointer::poll(uint64_t icount){
+    bool ret = false;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (every_instr && icount >= next_instr)
+        ret = true;
+    if (every_sec && now - last >= std::chrono::seconds(every_sec))
+        ret = true;
+    if (ret){
+        next_instr = icount + every_instr;
+        last = now;
+    }
+
+    next_check = every_instr ? next_instr : std::numeric_limits<uint64_t>::max();
+    if (every_sec && next_check > icount + CLOCK_POLL_INSTR)
+        next_check = icount + CLOCK_POLL_INSTR;
+    return ret;
+}
+
+template int writeCheckpoint<uint16_t, uint16_t>(const std::string&, Core<uint16_t, uint16_t>&, Memory<uint16_t>&, uint16_t);
+template int writeCheckpoint<uint32_t, uint32_t>(const std::string&, Core<uint32_t, uint32_t>&, Memory<uint32_t>&, uint32_t);
+template int readCheckpoint<uint16_t, uint16_t>(const std::string&, Core<uint16_t, uint16_t>&, Memory<uint16_t>&, uint16_t&);
+template int readCheckpoint<uint32_t, uint32_t>(const std::string&, Core<uint32_t, uint32_t>&, Memory<uint32_t>&, uint32_t&);
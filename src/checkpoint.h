@@ -0,0 +1,80 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include "models.h"
+#include <string>
+#include <vector>
+#include <chrono>
+
+/*
+ * Checkpoint file format, version 4, all the multi-byte fields are big-endian (as in the input file).
+ * A is the address size (2 bytes for Toy1, 4 bytes for Toy2), W is the word (register) size
+ *
+ *   "TCKP"                         4 bytes, magic
+ *   version                        2 bytes
+ *   address size, word size        1 + 1 bytes
+ *   code_sz                        A bytes, size of the verified code section
+ *   icount                         8 bytes, fetched instructions counter
+ *   cycles                         8 bytes, core time
+ *   ip                             A bytes
+ *   fetched_instr                  4 bytes
+ *   r0..r15                        16 x W bytes
+ *   ranges count                   2 bytes
+ *   for every memory range, in the order of registration:
+ *     name length, name            1 byte + name length bytes
+ *     start, end                   A + A bytes
+ *     mode                         1 byte
+ *     pages count                  4 bytes
+ *     for every populated page:
+ *       page number                A bytes
+ *       page record                PAGE_RECORD_SIZE bytes, see MemoryPage::store
+ *     for special (i/o) ranges only:
+ *     events count                 4 bytes
+ *     for every pending device event, in the order they happen:
+ *       time, addr, value          8 + A + W bytes
+ */
+const uint16_t CHECKPOINT_VERSION = 4;
+
+template <typename Addr, typename Word>
+int writeCheckpoint(const std::string& file, Core<Addr, Word>& core, Memory<Addr>& memory, Addr code_sz);
+template <typename Addr, typename Word>
+int readCheckpoint(const std::string& file, Core<Addr, Word>& core, Memory<Addr>& memory, Addr& code_sz);
+// address size of the checkpointed machine, 0 if the file is not a readable checkpoint
+int checkpointWidth(const std::string& file);
+
+// big-endian fields of the binary files (checkpoints, the image cache), getField moves the position forward
+void putField(std::string& buf, uint64_t value, uint8_t bytes);
+int getField(const uint8_t *data, size_t size, size_t& pos, uint64_t& value, uint8_t bytes);
+// 'what' names the file kind in the error messages, the file content may be given in parts
+int writeFileAtomically(const std::string& file, const std::string& buf, const std::string& what);
+int writeFileAtomically(const std::string& file, const std::vector<const std::string*>& parts, const std::string& what);
+std::shared_ptr<const void> mapFile(const std::string& file, size_t& size, const std::string& what);
+
+/*
+ * Decides when the next periodic checkpoint shall be taken, by the instruction count and/or by the wall time
+ */
+class Checkpointer{
+    private:
+        std::string file;
+        // 0 = disabled
+        uint64_t every_instr;
+        uint32_t every_sec;
+        // the instruction count of the next check, the clock is polled only every so often
+        uint64_t next_check;
+        uint64_t next_instr;
+        std::chrono::steady_clock::time_point last;
+    public:
+        Checkpointer(const std::string& file, uint64_t every_instr, uint32_t every_sec, uint64_t icount);
+
+        bool enabled() {return !file.empty() && (every_instr || every_sec);};
+        // cheap enough to be called between every two instructions
+        bool due(uint64_t icount) {return icount >= next_check && poll(icount);};
+        bool poll(uint64_t icount);
+        template <typename Addr, typename Word>
+        int take(Core<Addr, Word>& core, Memory<Addr>& memory, Addr code_sz){
+            return writeCheckpoint<Addr, Word>(file, core, memory, code_sz);
+        };
+
+        ~Checkpointer() {};
+};
+
+#endif
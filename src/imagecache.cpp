@@ -0,0 +1,280 @@
+#include "imagecache.h"
+#include "checkpoint.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <sys/stat.h>
+
+template <typename Addr>
+bool CachedImage<Addr>::matches(const std::string& input) const{
+    return size == input.size() && !memcmp(input.data(), source, size);
+}
+
+template <typename Addr>
+void CachedImage<Addr>::attachPages(Memory<Addr>& memory) const{
+    for (size_t i = 0; i < layout.sections.size(); i++){
+        MemoryRange<Addr>* range = memory.getRangeByName(layout.sections[i].name);
+        for (auto it = pages[i].begin(); it != pages[i].end(); ++it)
+            range->attachLazyPage(it->first, it->second, owner);
+    }
+}
+
+/*
+ * Serialize the cache file head, everything up to the image itself
+ */
+template <typename Addr>
+static std::string storeHead(uint64_t hash, uint64_t size){
+    std::string buf = "TIMG";
+    putField(buf, IMAGE_CACHE_VERSION, 2);
+    putField(buf, ISA_REVISION, 1);
+    putField(buf, sizeof(Addr), 1);
+    putField(buf, hash, 8);
+    putField(buf, size, 8);
+    return buf;
+}
+
+/*
+ * Serialize the loaded image in the cache file format, everything after the image itself
+ */
+template <typename Addr>
+static std::string storeBody(const ImageLayout<Addr>& layout, Memory<Addr>& memory, const VerifierReport<Addr>& report){
+    const uint8_t A = sizeof(Addr);
+    std::string buf = layout.header;
+    putField(buf, layout.code_sz, A);
+    putField(buf, layout.cdata, A);
+    putField(buf, layout.cdata_sz, A);
+    putField(buf, layout.smc, A);
+    putField(buf, layout.data, A);
+    putField(buf, layout.data_sz, A);
+    putField(buf, layout.mem, A);
+    putField(buf, layout.dbg_sz, A);
+
+    putField(buf, layout.sections.size(), 2);
+    uint8_t record[PAGE_RECORD_SIZE];
+    for (auto it = layout.sections.begin(); it != layout.sections.end(); ++it){
+        putField(buf, it->name.size(), 1);
+        buf += it->name;
+        putField(buf, it->start, A);
+        putField(buf, it->end, A);
+        putField(buf, it->mode, 1);
+        MemoryRange<Addr>* range = memory.getRangeByName(it->name);
+        std::vector<Addr> numbers = range->getPageNumbers();
+        putField(buf, numbers.size(), 4);
+        for (auto page_it = numbers.begin(); page_it != numbers.end(); ++page_it){
+            putField(buf, *page_it, A);
+            range->getPopulatedPage(*page_it)->store(record);
+            buf.append((const char*)record, PAGE_RECORD_SIZE);
+        }
+    }
+
+    putField(buf, report.verified.size(), 4);
+    for (auto it = report.verified.begin(); it != report.verified.end(); ++it)
+        putField(buf, *it, 4);
+    putField(buf, report.problems.size(), 4);
+    for (auto it = report.problems.begin(); it != report.problems.end(); ++it){
+        putField(buf, it->first, A);
+        putField(buf, it->second.size(), 2);
+        buf += it->second;
+    }
+    return buf;
+}
+
+/*
+ * Read the serialized image body (see storeBody), the page records are not copied
+ */
+template <typename Addr>
+static int readBody(const uint8_t *data, size_t size, CachedImage<Addr>& image){
+    const uint8_t A = sizeof(Addr);
+    ImageLayout<Addr>& layout = image.layout;
+    size_t pos = 0;
+    uint64_t field = 0;
+    int ret = 0;
+
+    if (size < 4)
+        return 1;
+    layout.header = std::string((const char*)data, 4);
+    pos += 4;
+
+    Addr* fields[] = {&layout.code_sz, &layout.cdata, &layout.cdata_sz, &layout.smc,
+                      &layout.data, &layout.data_sz, &layout.mem, &layout.dbg_sz};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++){
+        ret += getField(data, size, pos, field, A);
+        *fields[i] = (Addr)field;
+    }
+
+    uint64_t sections = 0;
+    ret += getField(data, size, pos, sections, 2);
+    for (uint64_t i = 0; i < sections && !ret; i++){
+        uint64_t name_len = 0;
+        uint64_t start = 0;
+        uint64_t end = 0;
+        uint64_t mode = 0;
+        uint64_t pages = 0;
+        ret += getField(data, size, pos, name_len, 1);
+        if (ret || pos + name_len > size)
+            return 1;
+        std::string name((const char*)data + pos, name_len);
+        pos += name_len;
+        ret += getField(data, size, pos, start, A);
+        ret += getField(data, size, pos, end, A);
+        ret += getField(data, size, pos, mode, 1);
+        ret += getField(data, size, pos, pages, 4);
+        if (ret)
+            return 1;
+        layout.sections.push_back(SectionDesc<Addr>(name, (Addr)start, (Addr)end, (uint8_t)mode));
+        image.pages.push_back(std::vector<std::pair<Addr, const uint8_t*> >());
+        for (uint64_t j = 0; j < pages; j++){
+            uint64_t page_no = 0;
+            ret += getField(data, size, pos, page_no, A);
+            if (ret || pos + PAGE_RECORD_SIZE > size)
+                return 1;
+            image.pages.back().push_back(std::make_pair((Addr)page_no, data + pos));
+            pos += PAGE_RECORD_SIZE;
+        }
+    }
+
+    uint64_t count = 0;
+    ret += getField(data, size, pos, count, 4);
+    for (uint64_t i = 0; i < count && !ret; i++){
+        ret += getField(data, size, pos, field, 4);
+        image.report.verified.push_back((uint32_t)field);
+    }
+    ret += getField(data, size, pos, count, 4);
+    for (uint64_t i = 0; i < count && !ret; i++){
+        uint64_t addr = 0;
+        uint64_t msg_len = 0;
+        ret += getField(data, size, pos, addr, A);
+        ret += getField(data, size, pos, msg_len, 2);
+        if (ret || pos + msg_len > size)
+            return 1;
+        image.report.problems.push_back(std::make_pair((Addr)addr, std::string((const char*)data + pos, msg_len)));
+        pos += msg_len;
+    }
+    if (ret || pos != size)
+        return 1;
+    return 0;
+}
+
+/*
+ * Read the whole serialized image, the page records are not copied, the owner keeps them alive.
+ * nullptr if it's not the image of the given input file or not the current format
+ */
+template <typename Addr>
+static std::shared_ptr<const CachedImage<Addr> > readImage(const uint8_t *data, size_t size, std::shared_ptr<const void> owner,
+                                                           uint64_t hash, const std::string& input){
+    const uint8_t A = sizeof(Addr);
+    std::shared_ptr<CachedImage<Addr> > image = std::make_shared<CachedImage<Addr> >();
+    size_t pos = 4;
+    uint64_t field = 0;
+    int ret = 0;
+
+    if (size < 4 || std::string((const char*)data, 4) != "TIMG")
+        return nullptr;
+    ret += getField(data, size, pos, field, 2);
+    if (ret || field != IMAGE_CACHE_VERSION)
+        return nullptr;
+    ret += getField(data, size, pos, field, 1);
+    if (ret || field != ISA_REVISION)
+        return nullptr;
+    ret += getField(data, size, pos, field, 1);
+    if (ret || field != A)
+        return nullptr;
+    ret += getField(data, size, pos, field, 8);
+    if (ret || field != hash)
+        return nullptr;
+    ret += getField(data, size, pos, field, 8);
+    if (ret || field != input.size() || pos + input.size() + 4 > size)
+        return nullptr;
+    image->source = data + pos;
+    image->size = input.size();
+    if (!image->matches(input))
+        return nullptr;
+    pos += input.size();
+    if (readBody(data + pos, size - pos, *image))
+        return nullptr;
+    image->owner = owner;
+    return image;
+}
+
+template <typename Addr>
+ImageCache<Addr>& ImageCache<Addr>::instance(){
+    static ImageCache<Addr> cache;
+    return cache;
+}
+
+template <typename Addr>
+std::string ImageCache<Addr>::fileName(const std::string& dir, uint64_t hash){
+    std::stringstream name;
+    name << dir << "/" << std::setfill('0') << std::setw(16) << std::hex << hash << ".timg";
+    return name.str();
+}
+
+template <typename Addr>
+std::shared_ptr<const CachedImage<Addr> > ImageCache<Addr>::find(uint64_t hash, const std::string& input, const std::string& dir){
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = images.find(hash);
+    if (it != images.end() && it->second->matches(input))
+        return it->second;
+    if (dir.empty())
+        return nullptr;
+
+    // a missing, broken or outdated file is a miss, the file is rewritten then
+    std::string file = fileName(dir, hash);
+    struct stat st;
+    if (stat(file.c_str(), &st) || st.st_size < 4)
+        return nullptr;
+    size_t file_size = 0;
+    std::shared_ptr<const void> owner = mapFile(file, file_size, "image cache");
+    if (owner == nullptr)
+        return nullptr;
+    std::shared_ptr<const CachedImage<Addr> > image = readImage<Addr>((const uint8_t*)owner.get(), file_size, owner, hash, input);
+    if (image == nullptr)
+        return nullptr;
+    images[hash] = image;
+    return image;
+}
+
+template <typename Addr>
+std::shared_ptr<const CachedImage<Addr> > ImageCache<Addr>::uncached(const ImageLayout<Addr>& layout, const VerifierReport<Addr>& report){
+    std::shared_ptr<CachedImage<Addr> > image = std::make_shared<CachedImage<Addr> >();
+    image->layout = layout;
+    image->report = report;
+    return image;
+}
+
+/*
+ * The file is written from the input and the serialized body as they are, the kept image refers to them
+ * with no copies either
+ */
+template <typename Addr>
+std::shared_ptr<const CachedImage<Addr> > ImageCache<Addr>::add(uint64_t hash, const std::shared_ptr<const std::string>& input,
+                                                                const ImageLayout<Addr>& layout, Memory<Addr>& memory,
+                                                                const VerifierReport<Addr>& report, const std::string& dir, bool keep){
+    std::string body = storeBody(layout, memory, report);
+    if (!dir.empty()){
+        std::string head = storeHead<Addr>(hash, input->size());
+        if (writeFileAtomically(fileName(dir, hash), {&head, input.get(), &body}, "image cache"))
+            simOut() << "The image is not cached on disk" << std::endl;
+    }
+    if (!keep)
+        return uncached(layout, report);
+
+    std::shared_ptr<std::pair<std::shared_ptr<const std::string>, std::string> > buffers =
+        std::make_shared<std::pair<std::shared_ptr<const std::string>, std::string> >(input, std::move(body));
+    std::shared_ptr<CachedImage<Addr> > image = std::make_shared<CachedImage<Addr> >();
+    if (readBody((const uint8_t*)buffers->second.data(), buffers->second.size(), *image))
+        return uncached(layout, report);
+    image->source = (const uint8_t*)input->data();
+    image->size = input->size();
+    image->owner = buffers;
+
+    std::lock_guard<std::mutex> guard(lock);
+    images[hash] = image;
+    return image;
+}
+
+template class CachedImage<uint16_t>;
+template class CachedImage<uint32_t>;
+template class ImageCache<uint16_t>;
+template class ImageCache<uint32_t>;
@@ -0,0 +1,156 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+#include "models.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/*
+ * A memory range of the image, as it's registered in the memory map
+ */
+template <typename Addr>
+class SectionDesc{
+    public:
+        std::string name;
+        Addr start;
+        Addr end;
+        uint8_t mode;
+
+        SectionDesc(const std::string& name, Addr start, Addr end, uint8_t mode) :
+            name(name),
+            start(start),
+            end(end),
+            mode(mode)
+            {};
+
+        ~SectionDesc() {};
+};
+
+/*
+ * Validated image layout: the loader fields and the memory ranges they describe,
+ * in the order of registration. The sections of a Toy3 image come from its section table,
+ * only code_sz of the loader fields is set then
+ */
+template <typename Addr>
+class ImageLayout{
+    public:
+        // image format, "Toy1", "Toy2" or "Toy3"
+        std::string header;
+        Addr code_sz;
+        Addr cdata;
+        Addr cdata_sz;
+        Addr smc;
+        Addr data;
+        Addr data_sz;
+        Addr mem;
+        Addr dbg_sz;
+        std::vector<SectionDesc<Addr> > sections;
+
+        ImageLayout() : header(), code_sz(0), cdata(0), cdata_sz(0), smc(0), data(0), data_sz(0), mem(0), dbg_sz(0) {};
+
+        ~ImageLayout() {};
+};
+
+/*
+ * Load-time verifier results: the proven code, empty if there were problems, and the problems themselves
+ */
+template <typename Addr>
+class VerifierReport{
+    public:
+        std::vector<uint32_t> verified;
+        // instruction address, message
+        std::vector<std::pair<Addr, std::string> > problems;
+
+        ~VerifierReport() {};
+};
+
+/*
+ * An image as it's kept by the cache: everything the loader and the verifier found out about it,
+ * so the image is neither parsed nor verified again
+ */
+template <typename Addr>
+class CachedImage{
+    public:
+        ImageLayout<Addr> layout;
+        // serialized pages of every section of the layout: page number, page record (see MemoryPage::store)
+        std::vector<std::vector<std::pair<Addr, const uint8_t*> > > pages;
+        VerifierReport<Addr> report;
+        // the input file content, the hash alone may collide
+        const uint8_t *source;
+        uint64_t size;
+        // keeps the page records and the source alive, a mapped cache file or the in-memory buffers
+        std::shared_ptr<const void> owner;
+
+        // attach the pages to the (registered) ranges of the layout, they are read on the first access
+        void attachPages(Memory<Addr>& memory) const;
+        // it's the image of the given input file
+        bool matches(const std::string& input) const;
+
+        CachedImage() : source(nullptr), size(0) {};
+
+        ~CachedImage() {};
+};
+
+/*
+ * Image cache file format, version 4, big-endian fields. A is the address size.
+ * A file is used only if its version, ISA revision, address size and image (the hash and all the bytes)
+ * match, otherwise the image is parsed again and the file is rewritten. Bump the version on any change
+ * of the format or the loader checks, the changes of the instruction set and the verifier bump ISA_REVISION
+ *
+ *   "TIMG"                         4 bytes, magic
+ *   version                        2 bytes
+ *   ISA revision                   1 byte
+ *   address size                   1 byte
+ *   image hash, image size         8 + 8 bytes, FNV-1a 64 of the whole input file
+ *   image                          image size bytes, the whole input file
+ *   image format                   4 bytes, the input file header
+ *   loader fields                  8 x A bytes: code_sz, cdata, cdata_sz, smc, data, data_sz, mem, dbg_sz
+ *   sections count                 2 bytes
+ *   for every section, in the order of registration:
+ *     name length, name            1 byte + name length bytes
+ *     start, end                   A + A bytes
+ *     mode                         1 byte
+ *     pages count                  4 bytes
+ *     for every populated page:
+ *       page number                A bytes
+ *       page record                PAGE_RECORD_SIZE bytes
+ *   verified instructions count    4 bytes
+ *   instructions                   4 bytes each
+ *   verifier problems count        4 bytes
+ *   for every problem:
+ *     address                      A bytes
+ *     message length, message      2 bytes + message length bytes
+ */
+const uint16_t IMAGE_CACHE_VERSION = 4;
+
+/*
+ * Content-addressed cache of the loaded images, keyed by the image hash. The images are kept in memory
+ * for the whole process (all the instances share them) and, given a directory, in files across processes.
+ * A single instance with no directory doesn't use the cache, the image is neither hashed nor serialized then
+ */
+template <typename Addr>
+class ImageCache{
+    private:
+        std::mutex lock;
+        std::unordered_map<uint64_t, std::shared_ptr<const CachedImage<Addr> > > images;
+
+        std::string fileName(const std::string& dir, uint64_t hash);
+    public:
+        static ImageCache& instance();
+
+        // nullptr if the image is in neither the memory nor the directory (empty = no directory)
+        std::shared_ptr<const CachedImage<Addr> > find(uint64_t hash, const std::string& input, const std::string& dir);
+        // cache the freshly loaded image, the memory holds its sections. The image is saved to the directory
+        // if there's one and kept in memory for the next instances if 'keep', it has no pages otherwise
+        std::shared_ptr<const CachedImage<Addr> > add(uint64_t hash, const std::shared_ptr<const std::string>& input,
+                                                      const ImageLayout<Addr>& layout, Memory<Addr>& memory,
+                                                      const VerifierReport<Addr>& report, const std::string& dir, bool keep);
+        // the image that is not cached at all: the layout and the verifier results only, no pages
+        static std::shared_ptr<const CachedImage<Addr> > uncached(const ImageLayout<Addr>& layout, const VerifierReport<Addr>& report);
+
+        ~ImageCache() {};
+};
+
+#endif
@@ -4,24 +4,55 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
-uint16_t MemoryRange::getStart(){
+static thread_local std::ostream* sim_out = nullptr;
+
+std::ostream& simOut(){
+    return sim_out == nullptr ? std::cout : *sim_out;
+}
+
+void setSimOut(std::ostream* out){
+    sim_out = out;
+}
+
+uint64_t fnv1a64(const uint8_t *data, size_t size, uint64_t hash){
+    for (size_t i = 0; i < size; i++){
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+template <typename Addr>
+Addr MemoryRange<Addr>::getStart(){
     return start;
 }
 
-uint16_t MemoryRange::getEnd(){
+template <typename Addr>
+Addr MemoryRange<Addr>::getEnd(){
     return end;
 }
 
-MemoryRange::~MemoryRange(){
+template <typename Addr>
+uint8_t MemoryRange<Addr>::getMode(){
+    return (special ? 0x8 : 0) | (readable ? 0x4 : 0) | (writeable ? 0x2 : 0) | (executable ? 0x1 : 0);
+}
+
+template <typename Addr>
+MemoryRange<Addr>::~MemoryRange(){
     
 }
 
-inline uint8_t MemoryRange::getUninitMem(){
+template <typename Addr>
+inline uint8_t MemoryRange<Addr>::getUninitMem(){
     return 0xff;
 }
 
-void MemoryRange::checkAccessPermissions(MemoryTransaction *req){
+template <typename Addr>
+void MemoryRange<Addr>::checkAccessPermissions(MemoryTransaction<Addr> *req){
     // check if access can granted, cases are obvious
     if (special){
         // since the i/o memory request have some special access rules we don't know,
@@ -48,24 +79,41 @@ void MemoryRange::checkAccessPermissions(MemoryTransaction *req){
     
 }
 
-void MemoryRange::directAccess(MemoryTransaction *req){
+template <typename Addr>
+void MemoryRange<Addr>::directAccess(MemoryTransaction<Addr> *req){
     // access to a memory cell with no respect to permissions
     uint8_t size = req->size;
     if (size > 4){
         throw std::invalid_argument("Memory request size must be <= 4");
     }
 
+    // requests hardly ever cross a page border, look the page up once
+    Addr page_no = req->addr >> PAGE_SHIFT;
+    MemoryPage* page = getPage(page_no, req->iswrite);
     if (req->iswrite){
         for (uint16_t i = 0; i < req->size; i++){
-            memory[req->addr + i] = (uint8_t)((*req->buf >> ((size - i - 1)*8)) & 0xff);
+            Addr addr = req->addr + i;
+            if ((addr >> PAGE_SHIFT) != page_no){
+                page_no = addr >> PAGE_SHIFT;
+                page = getPage(page_no, true);
+            }
+            page->data[addr & (PAGE_SIZE - 1)] = (uint8_t)((*req->buf >> ((size - i - 1)*8)) & 0xff);
+            page->valid.set(addr & (PAGE_SIZE - 1));
         }
     }
     else{
         uint32_t buf = 0;
         for (uint16_t i = 0; i < req->size; i++){
-            auto it = memory.find(req->addr + i);
+            Addr addr = req->addr + i;
+            if ((addr >> PAGE_SHIFT) != page_no){
+                page_no = addr >> PAGE_SHIFT;
+                page = getPage(page_no, false);
+            }
             buf <<= 8;
-            buf |= it == memory.end() ? (uint32_t)getUninitMem() : (uint32_t)it->second;
+            if (page != nullptr && page->valid.test(addr & (PAGE_SIZE - 1)))
+                buf |= (uint32_t)page->data[addr & (PAGE_SIZE - 1)];
+            else
+                buf |= (uint32_t)getUninitMem();
         }
         *req->buf = buf;
     }
@@ -73,28 +121,352 @@ void MemoryRange::directAccess(MemoryTransaction *req){
     
 }
 
+template <typename Addr>
+void MemoryRange<Addr>::readBlock(Addr addr, uint8_t *buf, size_t len){
+    while (len){
+        uint16_t offset = addr & (PAGE_SIZE - 1);
+        size_t n = std::min(len, (size_t)(PAGE_SIZE - offset));
+        MemoryPage* page = getPage(addr >> PAGE_SHIFT, false);
+        if (page == nullptr)
+            std::fill(buf, buf + n, getUninitMem());
+        else if (page->valid.all())
+            std::copy(page->data + offset, page->data + offset + n, buf);
+        else
+            for (size_t i = 0; i < n; i++)
+                buf[i] = page->valid.test(offset + i) ? page->data[offset + i] : getUninitMem();
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+template <typename Addr>
+void MemoryRange<Addr>::writeBlock(Addr addr, const uint8_t *buf, size_t len){
+    while (len){
+        uint16_t offset = addr & (PAGE_SIZE - 1);
+        size_t n = std::min(len, (size_t)(PAGE_SIZE - offset));
+        MemoryPage* page = getPage(addr >> PAGE_SHIFT, true);
+        std::copy(buf, buf + n, page->data + offset);
+        if (n == PAGE_SIZE)
+            page->valid.set();
+        else
+            for (size_t i = 0; i < n; i++)
+                page->valid.set(offset + i);
+        addr += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+template <typename Addr>
+void MemoryRange<Addr>::fillBlock(Addr addr, uint8_t value, size_t len){
+    while (len){
+        uint16_t offset = addr & (PAGE_SIZE - 1);
+        size_t n = std::min(len, (size_t)(PAGE_SIZE - offset));
+        MemoryPage* page = getPage(addr >> PAGE_SHIFT, true);
+        std::fill(page->data + offset, page->data + offset + n, value);
+        if (n == PAGE_SIZE)
+            page->valid.set();
+        else
+            for (size_t i = 0; i < n; i++)
+                page->valid.set(offset + i);
+        addr += n;
+        len -= n;
+    }
+}
+
+/*
+ * Find the page with the given number, faulting it in from the lazy backing if needed.
+ * Returns nullptr for a never touched page unless it's asked to be created.
+ * The page is going to be written if it's asked to be created, so a shared page gets copied
+ */
+template <typename Addr>
+MemoryPage* MemoryRange<Addr>::getPage(Addr page_no, bool create){
+    auto it = pages.find(page_no);
+    if (it != pages.end()){
+        if (create && it->second->shared)
+            it->second = newPage(page_no, it->second.get());
+        return it->second.get();
+    }
+
+    std::shared_ptr<MemoryPage> page;
+    auto lazy_it = lazy_pages.find(page_no);
+    if (lazy_it != lazy_pages.end()){
+        page = newPage(page_no, nullptr);
+        page->load(lazy_it->second);
+        lazy_pages.erase(lazy_it);
+    }
+    else if (create){
+        page = newPage(page_no, nullptr);
+    }
+    else{
+        return nullptr;
+    }
+    pages[page_no] = page;
+    return page.get();
+}
+
+/*
+ * A new private page, blank or a copy of the given one. It's placed in the page slot if there's a storage bound
+ */
+template <typename Addr>
+std::shared_ptr<MemoryPage> MemoryRange<Addr>::newPage(Addr page_no, const MemoryPage* copy){
+    MemoryPage* page = nullptr;
+    if (!slots){
+        page = copy == nullptr ? new MemoryPage() : new MemoryPage(*copy);
+        page->shared = false;
+        return std::shared_ptr<MemoryPage>(page);
+    }
+    page = slots(page_no);
+    if (copy == nullptr)
+        new (page) MemoryPage();
+    else if (copy != page)
+        new (page) MemoryPage(*copy);
+    page->shared = false;
+    // the slots belong to the storage
+    return std::shared_ptr<MemoryPage>(page, [](MemoryPage*){});
+}
+
+template <typename Addr>
+std::vector<Addr> MemoryRange<Addr>::getPageNumbers(){
+    std::vector<Addr> numbers;
+    for (auto it = pages.begin(); it != pages.end(); ++it)
+        numbers.push_back(it->first);
+    for (auto it = lazy_pages.begin(); it != lazy_pages.end(); ++it)
+        numbers.push_back(it->first);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+template <typename Addr>
+void MemoryRange<Addr>::attachLazyPage(Addr page_no, const uint8_t *record, std::shared_ptr<const void> owner){
+    pages.erase(page_no);
+    lazy_pages[page_no] = record;
+    lazy_owner = owner;
+}
+
+template <typename Addr>
+void MemoryRange<Addr>::sharePages(){
+    // the pages in a bound storage stay where they are
+    if (slots)
+        return;
+    std::vector<Addr> numbers = getPageNumbers();
+    for (auto it = numbers.begin(); it != numbers.end(); ++it){
+        getPage(*it, false);
+        std::shared_ptr<MemoryPage>& page = pages[*it];
+        if (!page->shared)
+            page = SharedPagePool::instance().intern(*page);
+    }
+}
+
+template <typename Addr>
+void MemoryRange<Addr>::bindStorage(const std::function<MemoryPage*(Addr)>& slots){
+    std::vector<Addr> numbers = getPageNumbers();
+    this->slots = slots;
+    for (auto it = numbers.begin(); it != numbers.end(); ++it){
+        // the lazy pages are faulted right in the slots
+        MemoryPage* page = getPage(*it, false);
+        if (page != slots(*it))
+            pages[*it] = newPage(*it, page);
+    }
+}
+
+SharedPagePool& SharedPagePool::instance(){
+    static SharedPagePool pool;
+    return pool;
+}
+
+std::shared_ptr<MemoryPage> SharedPagePool::intern(const MemoryPage& page){
+    uint8_t record[PAGE_RECORD_SIZE];
+    page.store(record);
+    uint64_t hash = fnv1a64(record, PAGE_RECORD_SIZE);
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto range = pages.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it){
+        std::shared_ptr<MemoryPage> pooled = it->second.lock();
+        // the hash may collide, compare the content too
+        if (pooled != nullptr && pooled->valid == page.valid && !std::memcmp(pooled->data, page.data, PAGE_SIZE))
+            return pooled;
+    }
+    MemoryPage* copy = new MemoryPage(page);
+    copy->shared = true;
+    std::shared_ptr<MemoryPage> pooled(copy, [hash](MemoryPage* p){ SharedPagePool::instance().release(hash, p); });
+    pages.emplace(hash, pooled);
+    return pooled;
+}
+
+/*
+ * The last range using the page is gone, forget it
+ */
+void SharedPagePool::release(uint64_t hash, MemoryPage* page){
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto range = pages.equal_range(hash);
+        for (auto it = range.first; it != range.second;){
+            if (it->second.expired())
+                it = pages.erase(it);
+            else
+                ++it;
+        }
+    }
+    delete page;
+}
+
+size_t SharedPagePool::size(){
+    std::lock_guard<std::mutex> guard(lock);
+    return pages.size();
+}
+
+void MemoryPage::load(const uint8_t *record){
+    for (uint16_t i = 0; i < PAGE_SIZE; i++)
+        valid[i] = (record[i >> 3] >> (i & 0x7)) & 0x1;
+    std::copy(record + PAGE_SIZE / 8, record + PAGE_RECORD_SIZE, data);
+}
+
+void MemoryPage::store(uint8_t *record) const{
+    std::fill(record, record + PAGE_SIZE / 8, 0);
+    for (uint16_t i = 0; i < PAGE_SIZE; i++)
+        record[i >> 3] |= (uint8_t)(valid[i] << (i & 0x7));
+    std::copy(data, data + PAGE_SIZE, record + PAGE_SIZE / 8);
+}
+
 // access to a memory cell with all the respect to permissions
-void MemoryRange::access(MemoryTransaction *req){
+template <typename Addr>
+void MemoryRange<Addr>::access(MemoryTransaction<Addr> *req){
     checkAccessPermissions(req);
     directAccess(req);
 }
 
 
-int Memory::registerMemoryRange(MemoryRange *range){
+template <typename Addr>
+MemoryRange<Addr>* newMemoryRange(Addr start, Addr end, uint8_t mode, const std::string &name){
+    if (mode & 0x8)
+        return new IoRange<Addr>(start, end, mode, name);
+    return new MemoryRange<Addr>(start, end, mode, name);
+}
+
+template <typename Addr>
+void IoRange<Addr>::scheduleEvent(const IoEvent<Addr>& event){
+    IoEvent<Addr> queued = event;
+    queued.seq = scheduled++;
+    events.push(queued);
+}
+
+template <typename Addr>
+void IoRange<Addr>::advance(uint64_t now){
+    while (!events.empty() && events.top().time <= now){
+        uint32_t value = events.top().value;
+        MemoryTransaction<Addr> req = MemoryTransaction<Addr>(events.top().addr, &value, events.top().size, 0, 1);
+        this->directAccess(&req);
+        events.pop();
+        fired++;
+    }
+}
+
+template <typename Addr>
+std::vector<IoEvent<Addr> > IoRange<Addr>::getEvents(){
+    std::vector<IoEvent<Addr> > pending;
+    std::priority_queue<IoEvent<Addr>, std::vector<IoEvent<Addr> >, std::greater<IoEvent<Addr> > > copy = events;
+    while (!copy.empty()){
+        pending.push_back(copy.top());
+        copy.pop();
+    }
+    return pending;
+}
+
+// a write to the DMA command register starts the operation
+template <typename Addr>
+void IoRange<Addr>::access(MemoryTransaction<Addr> *req){
+    MemoryRange<Addr>::access(req);
+    Addr cmd = AddressSpace<Addr>::dma_base + DMA_CMD * dma_word;
+    if (dma_memory != nullptr && req->iswrite && req->addr < cmd + dma_word && (Addr)(req->addr + req->size - 1) >= cmd)
+        runDma();
+}
+
+template <typename Addr>
+uint32_t IoRange<Addr>::readDmaRegister(uint8_t reg){
+    uint32_t value = 0;
+    MemoryTransaction<Addr> req = MemoryTransaction<Addr>(AddressSpace<Addr>::dma_base + reg * dma_word, &value, dma_word, 0, 0);
+    this->directAccess(&req);
+    return value;
+}
+
+template <typename Addr>
+void IoRange<Addr>::writeDmaRegister(uint8_t reg, uint32_t value){
+    MemoryTransaction<Addr> req = MemoryTransaction<Addr>(AddressSpace<Addr>::dma_base + reg * dma_word, &value, dma_word, 0, 1);
+    this->directAccess(&req);
+}
+
+// the block overlaps the range, e.g. it would write the device registers
+template <typename Addr>
+bool IoRange<Addr>::touches(Addr addr, Addr len){
+    return len && addr <= this->getEnd() && (Addr)(addr + len - 1) >= this->getStart();
+}
+
+/*
+ * Run the command the guest has written, a failed operation leaves the memory as it was.
+ * The accessing core is stalled for a cycle per word of the length of a done operation
+ */
+template <typename Addr>
+void IoRange<Addr>::runDma(){
+    if (dma_busy)
+        return;
+    Addr src = (Addr)readDmaRegister(DMA_SRC);
+    Addr dst = (Addr)readDmaRegister(DMA_DST);
+    Addr len = (Addr)readDmaRegister(DMA_LEN);
+    uint32_t value = readDmaRegister(DMA_VALUE);
+    uint32_t cmd = readDmaRegister(DMA_CMD);
+    uint32_t status = DMA_DONE;
+    // memset has no source block
+    if (touches(dst, len) || (cmd != DMA_MEMSET && touches(src, len))){
+        writeDmaRegister(DMA_STATUS, DMA_FAULT);
+        return;
+    }
+    dma_busy = true;
+    try{
+        switch (cmd){
+            case DMA_MEMCPY:
+                dma_memory->copy(dst, src, len);
+                break;
+            case DMA_MEMSET:
+                dma_memory->fill(dst, (uint8_t)value, len);
+                break;
+            case DMA_COMPARE:
+                writeDmaRegister(DMA_VALUE, dma_memory->compare(src, dst, len));
+                break;
+            default:
+                status = DMA_BAD_COMMAND;
+        }
+    }
+    catch (std::domain_error& e){
+        status = DMA_FAULT;
+    }
+    catch (std::out_of_range& e){
+        status = DMA_FAULT;
+    }
+    dma_busy = false;
+    if (status == DMA_DONE)
+        dma_memory->stall(len / dma_word + (len % dma_word != 0));
+    writeDmaRegister(DMA_STATUS, status);
+}
+
+template <typename Addr>
+int Memory<Addr>::registerMemoryRange(MemoryRange<Addr> *range){
     int ret = 0;
-    uint16_t start = range->getStart();
-    uint16_t end = range->getEnd();
+    Addr start = range->getStart();
+    Addr end = range->getEnd();
 
     // check if the memory range overlaps with an existing one
     for (auto it = bounds.begin(); it != bounds.end(); ++it){
         // there're 6 cases of intervals positioning, only 2 of them are acceptable
-        if (!((it->first < start && it->second < end) || (it->first > end && it->second > end))){
+        if (!(it->second < start || it->first > end)){
             ret = 1;
             break;
         }
     }
     try{
-        this->bounds.emplace_back(std::pair<int, int>(start, end));
+        this->bounds.emplace_back(std::pair<Addr, Addr>(start, end));
         this->memranges.push_back(range);
     }
     catch (std::bad_alloc& e){
@@ -104,13 +476,15 @@ int Memory::registerMemoryRange(MemoryRange *range){
     return ret;
 }
 
-Memory::~Memory(){
+template <typename Addr>
+Memory<Addr>::~Memory(){
     for (auto it = memranges.begin(); it != memranges.end(); ++it){
         delete *it;
     }
 }
 
-MemoryRange* Memory::getRangeByName(std::string name){
+template <typename Addr>
+MemoryRange<Addr>* Memory<Addr>::getRangeByName(std::string name){
     for (auto it = memranges.begin(); it != memranges.end(); ++it){
         if (!name.compare((*it)->getName())){
             return *it;
@@ -119,19 +493,34 @@ MemoryRange* Memory::getRangeByName(std::string name){
     return nullptr;
 }
 
-void Memory::access(MemoryTransaction* req){
-    uint16_t addr_hi = req->addr;
-    uint16_t addr_lo = req->addr + req->size - 1;
+template <typename Addr>
+MemoryRange<Addr>* Memory<Addr>::getRangeByAddr(Addr addr){
     for (auto it = bounds.begin(); it != bounds.end(); ++it){
-        uint16_t bound_lo = it->first;
-        uint16_t bound_hi = it->second;
+        if (addr >= it->first && addr <= it->second){
+            return memranges.at(it - bounds.begin());
+        }
+    }
+    return nullptr;
+}
+
+template <typename Addr>
+void Memory<Addr>::access(MemoryTransaction<Addr>* req){
+    Addr addr_hi = req->addr;
+    Addr addr_lo = req->addr + req->size - 1;
+    for (auto it = bounds.begin(); it != bounds.end(); ++it){
+        Addr bound_lo = it->first;
+        Addr bound_hi = it->second;
         // linear search through an array
         // TODO -> to hashed search
         if (addr_hi >= bound_lo && addr_hi <= bound_hi){
             // the hightes byte (big-endian) is withing the range, check if the lowest one is not out of range
             if ((addr_lo >= bound_lo) && (addr_lo <= bound_hi)){
                 // all clear, access the range with corresponding index
-                memranges.at(it - bounds.begin())->access(req);
+                MemoryRange<Addr>* range = memranges.at(it - bounds.begin());
+                if (trapping && (traps[addr_hi >> PAGE_SHIFT] || traps[addr_lo >> PAGE_SHIFT]))
+                    trappedAccess(range, req);
+                else
+                    range->access(req);
                 return;
             }
             else{
@@ -142,36 +531,243 @@ void Memory::access(MemoryTransaction* req){
     throw std::out_of_range("memory request to nowhere");
 }
 
-void Memory::memoryDump(){
+template <typename Addr>
+void Memory<Addr>::shareReadOnlyPages(){
+    for (auto it = memranges.begin(); it != memranges.end(); ++it){
+        uint8_t mode = (*it)->getMode();
+        // i/o registers change on their own, data and heap are written by the guest
+        if (!(mode & 0x8) && (!(mode & 0x2) || (mode & 0x1)))
+            (*it)->sharePages();
+    }
+}
+
+/*
+ * Watch the given address range, pages it touches get flagged with trap bits
+ */
+template <typename Addr>
+void Memory<Addr>::addWatchpoint(Addr lo, Addr hi, uint8_t kind){
+    // a byte per page of the whole address space
+    if (!trapping)
+        traps.resize(((size_t)AddressSpace<Addr>::last >> PAGE_SHIFT) + 1, 0);
+    trapping = true;
+    exec_trapping = exec_trapping || (kind & WATCH_EXEC);
+    watchpoints.push_back(Watchpoint<Addr>(lo, hi, kind));
+    // the trap bits keep the watched access kinds, so that data watchpoints don't slow down fetches
+    for (size_t page = lo >> PAGE_SHIFT; page <= (size_t)(hi >> PAGE_SHIFT); page++)
+        traps[page] |= kind;
+}
+
+/*
+ * Slow path of an access to a page with trap bits, the watchpoints are looked through
+ * and a hit is recorded once the access is done
+ */
+template <typename Addr>
+void Memory<Addr>::trappedAccess(MemoryRange<Addr>* range, MemoryTransaction<Addr> *req){
+    uint8_t kind = req->iswrite ? WATCH_WRITE : req->exec ? WATCH_EXEC : WATCH_READ;
+    Addr addr_lo = req->addr + req->size - 1;
+    bool watched = false;
+    for (auto it = watchpoints.begin(); it != watchpoints.end(); ++it){
+        if ((it->kind & kind) && req->addr <= it->hi && addr_lo >= it->lo){
+            watched = true;
+            break;
+        }
+    }
+    if (!watched){
+        range->access(req);
+        return;
+    }
+
+    uint32_t old_value = 0;
+    MemoryTransaction<Addr> peek = MemoryTransaction<Addr>(req->addr, &old_value, req->size, 0, 0);
+    range->directAccess(&peek);
+    range->access(req);
+
+    hit.kind = kind;
+    hit.addr = req->addr;
+    hit.size = req->size;
+    hit.old_value = old_value;
+    hit.new_value = *req->buf;
+    hit_pending = true;
+}
+
+template <typename Addr>
+MemoryRange<Addr>* Memory<Addr>::blockRange(Addr addr, Addr len, bool iswrite){
+    Addr addr_lo = addr + len - 1;
+    MemoryRange<Addr>* range = getRangeByAddr(addr);
+    if (range == nullptr)
+        throw std::out_of_range("memory request to nowhere");
+    if (addr_lo < addr || addr_lo > range->getEnd())
+        throw std::out_of_range("memory request is out of map region boundaries");
+    // the permissions are the same for all the bytes of a range
+    MemoryTransaction<Addr> req = MemoryTransaction<Addr>(addr, nullptr, 1, 0, iswrite);
+    range->checkAccessPermissions(&req);
+    return range;
+}
+
+template <typename Addr>
+bool Memory<Addr>::isTrapped(Addr addr, Addr len){
+    if (!trapping)
+        return false;
+    for (size_t page = addr >> PAGE_SHIFT; page <= (size_t)((Addr)(addr + len - 1) >> PAGE_SHIFT); page++)
+        if (traps[page] & (WATCH_READ | WATCH_WRITE))
+            return true;
+    return false;
+}
+
+/*
+ * The bulk operations go through a bounce buffer, a chunk at a time; the watched blocks are accessed
+ * byte by byte instead, so that the watchpoints see the accesses
+ */
+template <typename Addr>
+void Memory<Addr>::copy(Addr dst, Addr src, Addr len){
+    if (len == 0)
+        return;
+    MemoryRange<Addr>* from = blockRange(src, len, false);
+    MemoryRange<Addr>* to = blockRange(dst, len, true);
+    // the overlapping blocks are copied from the end if the destination is above the source
+    bool backwards = from == to && dst > src && dst - src < len;
+    if (isTrapped(src, len) || isTrapped(dst, len)){
+        for (size_t i = 0; i < len; i++){
+            Addr offset = backwards ? len - 1 - i : i;
+            uint32_t byte = 0;
+            MemoryTransaction<Addr> load = MemoryTransaction<Addr>(src + offset, &byte, 1, 0, 0);
+            access(&load);
+            MemoryTransaction<Addr> store = MemoryTransaction<Addr>(dst + offset, &byte, 1, 0, 1);
+            access(&store);
+        }
+        return;
+    }
+    uint8_t buf[PAGE_SIZE * 16];
+    for (size_t done = 0; done < len; ){
+        size_t n = std::min((size_t)len - done, sizeof(buf));
+        Addr offset = backwards ? len - done - n : done;
+        from->readBlock(src + offset, buf, n);
+        to->writeBlock(dst + offset, buf, n);
+        done += n;
+    }
+}
+
+template <typename Addr>
+void Memory<Addr>::fill(Addr dst, uint8_t value, Addr len){
+    if (len == 0)
+        return;
+    MemoryRange<Addr>* to = blockRange(dst, len, true);
+    if (isTrapped(dst, len)){
+        for (size_t i = 0; i < len; i++){
+            uint32_t byte = value;
+            MemoryTransaction<Addr> store = MemoryTransaction<Addr>(dst + i, &byte, 1, 0, 1);
+            access(&store);
+        }
+        return;
+    }
+    to->fillBlock(dst, value, len);
+}
+
+template <typename Addr>
+Addr Memory<Addr>::compare(Addr src, Addr dst, Addr len){
+    if (len == 0)
+        return 0;
+    MemoryRange<Addr>* first = blockRange(src, len, false);
+    MemoryRange<Addr>* second = blockRange(dst, len, false);
+    if (isTrapped(src, len) || isTrapped(dst, len)){
+        for (size_t i = 0; i < len; i++){
+            uint32_t a = 0;
+            uint32_t b = 0;
+            MemoryTransaction<Addr> load_a = MemoryTransaction<Addr>(src + i, &a, 1, 0, 0);
+            access(&load_a);
+            MemoryTransaction<Addr> load_b = MemoryTransaction<Addr>(dst + i, &b, 1, 0, 0);
+            access(&load_b);
+            if (a != b)
+                return i;
+        }
+        return len;
+    }
+    uint8_t buf_a[PAGE_SIZE * 8];
+    uint8_t buf_b[PAGE_SIZE * 8];
+    for (size_t done = 0; done < len; ){
+        size_t n = std::min((size_t)len - done, sizeof(buf_a));
+        first->readBlock(src + done, buf_a, n);
+        second->readBlock(dst + done, buf_b, n);
+        size_t equal = std::mismatch(buf_a, buf_a + n, buf_b).first - buf_a;
+        if (equal < n)
+            return done + equal;
+        done += n;
+    }
+    return len;
+}
+
+/*
+ * The words of a burst are all in one range and the bounds and the permissions are checked before any of them
+ * is accessed, so a faulting burst transfers no word at all. The bursts to the watched pages and to the i/o range
+ * are split into word accesses, so that the watchpoints and the devices see them. These accesses are checked
+ * already and cannot fault, a watchpoint hit doesn't stop them: the burst completes and the hit is reported after it
+ */
+template <typename Addr>
+void Memory<Addr>::burst(Addr addr, uint32_t *words, uint8_t count, uint8_t size, bool iswrite){
+    Addr len = count * size;
+    MemoryRange<Addr>* range = blockRange(addr, len, iswrite);
+    if ((range->getMode() & 0x8) || isTrapped(addr, len)){
+        for (uint8_t i = 0; i < count; i++){
+            MemoryTransaction<Addr> req = MemoryTransaction<Addr>(addr + i * size, &words[i], size, 0, iswrite);
+            access(&req);
+        }
+        return;
+    }
+    // big-endian words, as the word accesses are
+    uint8_t buf[16 * 4];
+    if (iswrite){
+        for (size_t i = 0; i < len; i++)
+            buf[i] = (uint8_t)(words[i / size] >> ((size - i % size - 1) * 8));
+        range->writeBlock(addr, buf, len);
+    }
+    else{
+        range->readBlock(addr, buf, len);
+        for (uint8_t i = 0; i < count; i++){
+            words[i] = 0;
+            for (uint8_t j = 0; j < size; j++)
+                words[i] = (words[i] << 8) | buf[i * size + j];
+        }
+    }
+}
+
+template <typename Addr>
+void Memory<Addr>::memoryDump(){
     // quick (in terms of code complexity) implementation just for debugging purposes (if needed)
     // requites a ton of time and extra memory
-    std::unordered_map<uint16_t, MemoryRange*> bound_range_unordered;
+    std::unordered_map<Addr, MemoryRange<Addr>*> bound_range_unordered;
     for (auto it = bounds.begin(); it != bounds.end(); ++it){
         bound_range_unordered[it->first] = memranges.at(it - bounds.begin());
     }
-    std::map<uint16_t, MemoryRange*> bound_range_ordered(bound_range_unordered.begin(), bound_range_unordered.end());
+    std::map<Addr, MemoryRange<Addr>*> bound_range_ordered(bound_range_unordered.begin(), bound_range_unordered.end());
     
-    std::cout << "-====== MEMORY DUMP ======-" << std::endl;
+    simOut() << "-====== MEMORY DUMP ======-" << std::endl;
     for(auto it = bound_range_ordered.begin(); it != bound_range_ordered.end(); ++it){
         // for each region from the very bottom of the memory pool in the ascending order
         // print the mem dump
-        std::cout << "=== " << it->second->getName() << " ===" << std::endl;
-        std::cout << "0x" << std::setfill('0') << std::setw(4) << std::hex
+        simOut() << "=== " << it->second->getName() << " ===" << std::endl;
+        simOut() << "0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex
                   << it->second->getStart() << " ---- section start " << std::endl;
         it->second->memoryDump();
-        std::cout << "0x" << std::setfill('0') << std::setw(4) << std::hex
+        simOut() << "0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex
                   << it->second->getEnd() << " ---- section end " << std::endl;
     }
-    std::cout << "-=========================-" << std::endl;
+    simOut() << "-=========================-" << std::endl;
 }
 
-void MemoryRange::memoryDump(){
+template <typename Addr>
+void MemoryRange<Addr>::memoryDump(){
     // debugging purposes only, prints all the used memory in a memory range in an ascending order
-    std::map<uint16_t, uint8_t> ordered_memory(memory.begin(), memory.end());
-    for(auto it = ordered_memory.begin(); it != ordered_memory.end(); ++it){
-        std::cout << "0x" << std::setfill('0') << std::setw(4) << std::hex << it->first
-                  << ":  0x" << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)it->second 
-                  << std::endl;
+    std::vector<Addr> numbers = getPageNumbers();
+    for(auto it = numbers.begin(); it != numbers.end(); ++it){
+        MemoryPage* page = getPage(*it, false);
+        for (uint16_t i = 0; i < PAGE_SIZE; i++){
+            if (!page->valid.test(i))
+                continue;
+            simOut() << "0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex
+                      << (Addr)((*it << PAGE_SHIFT) | i)
+                      << ":  0x" << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)page->data[i] 
+                      << std::endl;
+        }
     }
 }
 
@@ -179,18 +775,41 @@ void MemoryRange::memoryDump(){
  * Created a relation between a memory subsystem and a core - 
  * every core's request will be fed to the bound memory
  */
-void Core::bindMemory(Memory* memory){
+template <typename Addr, typename Word>
+void Core<Addr, Word>::bindMemory(Memory<Addr>* memory){
     this->memory = memory;
 }
 
+/*
+ * Attach the code proven by the load-time verifier, it starts at 'start' and is never written,
+ * so fetches from it need neither routing nor permission checks. Pass nullptr to get back to checked fetches
+ */
+template <typename Addr, typename Word>
+void Core<Addr, Word>::bindVerifiedCode(Addr start, const std::vector<uint32_t>* code){
+    // breakpoints shall be set by now, their pages are fetched the checked way
+    exec_traps = memory->getExecTraps();
+    verified_code = code;
+    verified_start = start;
+    verified_end = code == nullptr ? start : start + code->size() * 4;
+}
+
 /*
  * Get the next instruction to execute
  */
-void Core::fetch(){
+template <typename Addr, typename Word>
+void Core<Addr, Word>::fetch(){
+    icount++;
+    fetched_ip = ip;
     if (log_en)
-        std::cout << "FETCH: 0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)ip << std::endl;
-    MemoryTransaction req = MemoryTransaction(ip, &fetched_instr, 4, 1, 0);
-    memory->access(&req);
+        simOut() << "FETCH: 0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)ip << std::endl;
+    if (ip >= verified_start && ip < verified_end && (exec_traps == nullptr || !(exec_traps[ip >> PAGE_SHIFT] & WATCH_EXEC))){
+        // fast path, the instruction is known to be fetchable and valid
+        fetched_instr = (*verified_code)[(ip - verified_start) >> 2];
+    }
+    else{
+        MemoryTransaction<Addr> req = MemoryTransaction<Addr>(ip, &fetched_instr, 4, 1, 0);
+        memory->access(&req);
+    }
     // next instruction has 4-byte offset
     ip += 4;
 }
@@ -198,7 +817,8 @@ void Core::fetch(){
 /*
  * Exec stage (merged with decode, memory access and writeback, because sadly there's no pipeline)
  */
-int Core::execute(){
+template <typename Addr, typename Word>
+int Core<Addr, Word>::execute(){
     // decode the instruction
     uint8_t opc = 0;
     uint8_t rd_index = 0;
@@ -207,7 +827,7 @@ int Core::execute(){
     uint16_t imm = 0;
 
     if (log_en)
-        std::cout << "DECODE: 0x" << std::setfill('0') << std::setw(8) << std::hex << fetched_instr << std::endl;
+        simOut() << "DECODE: 0x" << std::setfill('0') << std::setw(8) << std::hex << fetched_instr << std::endl;
 
     opc = (uint8_t)(fetched_instr >> 28);
     rd_index = (uint8_t)((fetched_instr >> 24) & 0xf);
@@ -215,20 +835,22 @@ int Core::execute(){
     rs2_index = (uint8_t)((fetched_instr >> 16) & 0xf);
     imm = (uint16_t)(fetched_instr & 0xffff);
 
-    uint16_t dummy = 0;
+    cycles += (opc == 0xd || opc == 0xe) ? 2 : (opc == 0xf) ? 2 + ((imm >> 11) & 0xf) : 1;
+
+    Word dummy = 0;
     // a case of dedicated r0 which cannot be written, create a link to a dummy stack variable
-    uint16_t &rd  = rd_index ? reg[rd_index] : dummy;
-    uint16_t &rs1 = reg[rs1_index];
-    uint16_t &rs2 = reg[rs2_index];
+    Word &rd  = rd_index ? reg[rd_index] : dummy;
+    Word &rs1 = reg[rs1_index];
+    Word &rs2 = reg[rs2_index];
 
     if (log_en)
-        std::cout << "EXECUTE: opc=0x" << std::hex << (uint32_t)opc
+        simOut() << "EXECUTE: opc=0x" << std::hex << (uint32_t)opc
                   << ", dest=r" << std::dec << (uint32_t)rd_index 
-                  << " 0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rd //<< "]"
+                  << " 0x" << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rd //<< "]"
                   << ", src1=r" << std::dec << (uint32_t)rs1_index 
-                  << " 0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rs1 //<< "]"
+                  << " 0x" << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rs1 //<< "]"
                   << ", src2=r" << std::dec << (uint32_t)rs2_index 
-                  << " 0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rs2 //<< "]"
+                  << " 0x" << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rs2 //<< "]"
                   << ", imm=0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)imm << std::endl;
     
 
@@ -243,16 +865,19 @@ int Core::execute(){
             rd = rs1 - (rs2 | imm);
             break;
         case 0x2:
-            // MUL
-            rd = (int16_t)rs1 * (int16_t)(rs2 | imm);
+            // MUL, the low word of the product is the same for signed and unsigned operands
+            rd = (Word)((uint64_t)rs1 * (Word)(rs2 | imm));
             break;
         case 0x3:
             // MODU
             rd = rs1 % (rs2 | imm);
             break;
         case 0x4:
-            // DIV
-            rd = (int16_t)rs1 / (int16_t)(rs2 | imm);
+            // DIV, the only overflowing case MIN / -1 wraps to MIN
+            if ((SWord)(rs2 | imm) == -1)
+                rd = (Word)(0 - rs1);
+            else
+                rd = (SWord)rs1 / (SWord)(rs2 | imm);
             break;
         case 0x5:
             // DIVU
@@ -267,16 +892,16 @@ int Core::execute(){
             rd = rs1 & (rs2 | imm);
             break;
         case 0x8:
-            // LSL
-            rd = rs1 << (rs2 | imm);
+            // LSL, the shifts by the word width and more shift all the bits out
+            rd = (rs2 | imm) < WORD_BITS ? rs1 << (rs2 | imm) : 0;
             break;
         case 0x9:
             // LSR
-            rd = rs1 >> (rs2 | imm);
+            rd = (rs2 | imm) < WORD_BITS ? rs1 >> (rs2 | imm) : 0;
             break;
         case 0xa:
-            // ASR
-            rd = (int16_t)rs1 >> (rs2 | imm);
+            // ASR, the shifts by the word width and more leave the sign bit only
+            rd = (SWord)rs1 >> ((rs2 | imm) < WORD_BITS ? (rs2 | imm) : WORD_BITS - 1);
             break;
         case 0xb:
             // CMP
@@ -299,19 +924,19 @@ int Core::execute(){
                     break;
                 case 0x4:
                     // LS
-                    rd = (int16_t)rs1 < (int16_t)rs2 ? 0 : 1;
+                    rd = (SWord)rs1 < (SWord)rs2 ? 0 : 1;
                     break;
                 case 0x5:
                     // GT
-                    rd = (int16_t)rs1 > (int16_t)rs2 ? 0 : 1;
+                    rd = (SWord)rs1 > (SWord)rs2 ? 0 : 1;
                     break;
                 case 0x6:
                     // GE
-                    rd = (int16_t)rs1 >= (int16_t)rs2 ? 0 : 1;
+                    rd = (SWord)rs1 >= (SWord)rs2 ? 0 : 1;
                     break;
                 case 0x7:
                     // LE
-                    rd = (int16_t)rs1 <= (int16_t)rs2 ? 0 : 1;
+                    rd = (SWord)rs1 <= (SWord)rs2 ? 0 : 1;
                     break;
                 case 0x8:
                     // BL
@@ -338,34 +963,72 @@ int Core::execute(){
             // BRN
             rd = ip + 4;
             if (!rs1){
-                uint16_t jump_dst = rs2 | imm;
+                Addr jump_dst = (Addr)(rs2 | imm);
                 if (jump_dst & 0x3)
                     // Got HALT
                     return 1;
-                else
+                else{
+                    // backward branches close the loops
+                    if (io != nullptr && jump_dst < ip)
+                        checkIdleLoop(jump_dst);
                     jump(jump_dst);
+                }
             }
             break;
         case 0xd:{
             // LD
             uint32_t buf; //TODO get rid of this variable
-            MemoryTransaction req = MemoryTransaction(imm + rs1 + rs2, (uint32_t*)&buf/*&rd*/, 2, 0, 0);
+            MemoryTransaction<Addr> req = MemoryTransaction<Addr>((Addr)(imm + rs1 + rs2), (uint32_t*)&buf/*&rd*/, sizeof(Word), 0, 0);
             memory->access(&req);
-            rd = (uint16_t)(buf & 0xffff);
+            rd = (Word)buf;
             if (log_en)
-                std::cout << "WRITEBACK: r" << std::dec << (uint32_t)rd_index << " <- [0x" 
-                          << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)req.addr << "] = 0x"
-                          << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rd << std::endl;
+                simOut() << "WRITEBACK: r" << std::dec << (uint32_t)rd_index << " <- [0x" 
+                          << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)req.addr << "] = 0x"
+                          << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rd << std::endl;
             break;
         }
         case 0xe:{
             // ST
             uint32_t buf = (uint32_t)rd; //TODO get rid of this variable
-            MemoryTransaction req = MemoryTransaction(imm + rs1 + rs2, (uint32_t*)&buf/*&rd*/, 2, 0, 1);
+            MemoryTransaction<Addr> req = MemoryTransaction<Addr>((Addr)(imm + rs1 + rs2), (uint32_t*)&buf/*&rd*/, sizeof(Word), 0, 1);
             memory->access(&req);
+            cycles += memory->takeStallCycles();
+            loop_stores = true;
             if (log_en)
-                std::cout << "WRITEBACK: [0x" << std::setw(4) << std::hex << (uint32_t)req.addr << "] <- 0x" 
-                          << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rd << std::endl;
+                simOut() << "WRITEBACK: [0x" << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)req.addr << "] <- 0x" 
+                          << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rd << std::endl;
+            break;
+        }
+        case 0xf:{
+            // LDM/STM, imm is the store flag (bit 15), the number of registers minus one (14:11) and the offset (10:0)
+            bool store = imm & 0x8000;
+            uint8_t count = ((imm >> 11) & 0xf) + 1;
+            if (rd_index + count > 16)
+                return 2;
+            uint32_t words[16];
+            Addr addr = (Addr)((imm & 0x7ff) + rs1 + rs2);
+            for (uint8_t i = 0; store && i < count; i++)
+                words[i] = (uint32_t)reg[rd_index + i];
+            // a faulting burst throws before any word is transferred, the registers are written back after it
+            memory->burst(addr, words, count, sizeof(Word), store);
+            cycles += memory->takeStallCycles();
+            if (store)
+                loop_stores = true;
+            else
+                for (uint8_t i = 0; i < count; i++)
+                    // r0 is never written
+                    if (rd_index + i)
+                        reg[rd_index + i] = (Word)words[i];
+            for (uint8_t i = 0; log_en && i < count; i++){
+                Addr word_addr = (Addr)(addr + i * sizeof(Word));
+                if (store)
+                    simOut() << "WRITEBACK: [0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)word_addr << "] <- 0x"
+                              << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << words[i] << std::endl;
+                else
+                    simOut() << "WRITEBACK: r" << std::dec << (uint32_t)(rd_index + i) << " <- [0x"
+                              << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)word_addr << "] = 0x"
+                              << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << words[i] << std::endl;
+            }
             break;
         }
         default:
@@ -374,23 +1037,91 @@ int Core::execute(){
     }
 
     if (log_en && (opc < 0xd))
-        std::cout << "WRITEBACK: r" << std::dec << (uint32_t)rd_index << " <- 0x" 
-                  << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)rd << std::endl;
+        simOut() << "WRITEBACK: r" << std::dec << (uint32_t)rd_index << " <- 0x" 
+                  << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)rd << std::endl;
 
 
     return 0;
 }
 
+/*
+ * Called on a taken backward branch to dst (before the jump). If the whole iteration since the previous
+ * branch to dst did no stores, saw no device events and left the register file as it was, the loop only spins waiting for i/o:
+ * its iterations are skipped up to the next device event, the counters advance as if they were executed
+ */
+template <typename Addr, typename Word>
+void Core<Addr, Word>::checkIdleLoop(Addr dst){
+    if (dst == loop_head && !loop_stores && io->getFiredCount() == loop_events && std::equal(loop_reg.begin(), loop_reg.end(), reg)){
+        uint64_t iter_icount = icount - loop_icount;
+        uint64_t iter_cycles = cycles - loop_cycles;
+        uint64_t next = io->nextEventTime();
+        // the skipped iterations end before the event fires, so they all see the same i/o values
+        if (next != NO_EVENT && next > cycles && iter_cycles){
+            uint64_t skip = (next - cycles - 1) / iter_cycles;
+            icount += skip * iter_icount;
+            cycles += skip * iter_cycles;
+            if (log_en && skip)
+                simOut() << "IDLE: skipped " << std::dec << skip << " iterations of the loop at 0x"
+                          << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << (uint32_t)dst << std::endl;
+        }
+    }
+    loop_head = dst;
+    std::copy(reg, reg + 16, loop_reg.begin());
+    loop_icount = icount;
+    loop_cycles = cycles;
+    loop_events = io->getFiredCount();
+    loop_stores = false;
+}
+
+/*
+ * Restore the state saved by a checkpoint, ip is set up in the constructor
+ */
+template <typename Addr, typename Word>
+void Core<Addr, Word>::restoreState(uint32_t fetched_instr, uint64_t icount, uint64_t cycles, const std::array<Word, 16>& reg){
+    this->fetched_instr = fetched_instr;
+    this->icount = icount;
+    this->cycles = cycles;
+    std::copy(reg.begin(), reg.end(), this->reg);
+    // r0 is hardwired to zero
+    this->reg[0] = 0;
+}
+
+template <typename Addr, typename Word>
+std::array<Word, 16> Core<Addr, Word>::getRegFile(){
+    std::array<Word, 16> copy;
+    std::copy(reg, reg + 16, copy.begin());
+    return copy;
+}
+
+template <typename Addr, typename Word>
+void Core<Addr, Word>::bindRegisters(Word *storage){
+    std::copy(reg, reg + 16, storage);
+    reg = storage;
+}
+
 /*
  * Prints core's register file
  */
-void Core::printRegFile(){
-    std::cout << "-====== Register File ======-" << std::endl;
+template <typename Addr, typename Word>
+void Core<Addr, Word>::printRegFile(){
+    simOut() << "-====== Register File ======-" << std::endl;
     for (size_t i = 0; i < 16; ++i){
-        std::cout << "r" << std::dec << i
-                  << ":  0x" << std::setfill('0') << std::setw(4) << std::hex << (uint32_t)reg[i] 
+        simOut() << "r" << std::dec << i
+                  << ":  0x" << std::setfill('0') << std::setw(sizeof(Word) * 2) << std::hex << (uint32_t)reg[i] 
                   << std::endl;
         
     }
-    std::cout << "-===========================-" << std::endl;
+    simOut() << "-===========================-" << std::endl;
 }
+
+// the Toy1 (16-bit) and Toy2 (32-bit) machines
+template class MemoryRange<uint16_t>;
+template class MemoryRange<uint32_t>;
+template class IoRange<uint16_t>;
+template class IoRange<uint32_t>;
+template class Memory<uint16_t>;
+template class Memory<uint32_t>;
+template class Core<uint16_t, uint16_t>;
+template class Core<uint32_t, uint32_t>;
+template MemoryRange<uint16_t>* newMemoryRange(uint16_t start, uint16_t end, uint8_t mode, const std::string &name);
+template MemoryRange<uint32_t>* newMemoryRange(uint32_t start, uint32_t end, uint8_t mode, const std::string &name);
@@ -4,11 +4,49 @@
 #include <unordered_map>
 #include <string>
 #include <array>
+#include <bitset>
+#include <memory>
+#include <cstdint>
+#include <queue>
+#include <functional>
+#include <type_traits>
+#include <mutex>
+#include <ostream>
 
+/*
+ * The simulator is parametrized by the address and the word (register) types:
+ * uint16_t/uint16_t is the Toy1 machine, uint32_t/uint32_t is the wide Toy2 one
+ */
+// simulator output, std::cout unless the running thread simulates one of several instances
+std::ostream& simOut();
+void setSimOut(std::ostream* out);
+
+// FNV-1a 64-bit hash, pass the previous result as 'hash' to continue hashing
+const uint64_t FNV1A_OFFSET = 0xcbf29ce484222325ULL;
+uint64_t fnv1a64(const uint8_t *data, size_t size, uint64_t hash = FNV1A_OFFSET);
+
+template <typename Addr>
+class AddressSpace{
+    public:
+        // the last 4 KB are the i/o space
+        static constexpr Addr io_base = (Addr)(~(Addr)0 - 0xfff);
+        // registers of the DMA device (see IoRange)
+        static constexpr Addr dma_base = (Addr)(io_base + 0xf00);
+        static constexpr Addr last = (Addr)~(Addr)0;
+        // hex digits of an address, for printing
+        static constexpr int digits = sizeof(Addr) * 2;
+};
+
+template <typename Addr> constexpr Addr AddressSpace<Addr>::io_base;
+template <typename Addr> constexpr Addr AddressSpace<Addr>::dma_base;
+template <typename Addr> constexpr Addr AddressSpace<Addr>::last;
+template <typename Addr> constexpr int AddressSpace<Addr>::digits;
+
+template <typename Addr>
 class MemoryTransaction{
     public:
         // reference address
-        uint16_t addr;
+        Addr addr;
         // data storage (either to store in or to load from), the type is the largest possible
         uint32_t *buf;
         // size of the request, in bytes
@@ -18,7 +56,7 @@ class MemoryTransaction{
         // flag is the request is a write one
         bool iswrite;
 
-        MemoryTransaction(uint16_t addr, uint32_t *buf, uint8_t size, bool exec, bool iswrite) :
+        MemoryTransaction(Addr addr, uint32_t *buf, uint8_t size, bool exec, bool iswrite) :
             addr(addr),
             buf(buf),
             size(size),
@@ -29,6 +67,49 @@ class MemoryTransaction{
         ~MemoryTransaction() {};
 };
 
+// memory ranges store their content by pages, only the touched pages are allocated
+const uint16_t PAGE_SHIFT = 8;
+const uint16_t PAGE_SIZE = 1 << PAGE_SHIFT;
+// serialized page: validity bitmap (LSB first) followed by the page data
+const uint16_t PAGE_RECORD_SIZE = PAGE_SIZE / 8 + PAGE_SIZE;
+
+class MemoryPage{
+    public:
+        uint8_t data[PAGE_SIZE];
+        // the bytes ever written, the rest of the page reads as uninitialized memory
+        std::bitset<PAGE_SIZE> valid;
+        // the page belongs to the shared pool and may be used by several ranges (and instances),
+        // it's never written, a range writing to it gets its own copy first
+        bool shared;
+
+        MemoryPage() : data(), shared(false) {};
+
+        void load(const uint8_t *record);
+        void store(uint8_t *record) const;
+
+        ~MemoryPage() {};
+};
+
+/*
+ * Read-only pages shared by all the memory ranges of the process: the pages of the same content
+ * are kept once, they are looked up by the content hash and reference counted by the ranges using them
+ */
+class SharedPagePool{
+    private:
+        std::mutex lock;
+        // content hash -> page, the pool doesn't keep the pages alive
+        std::unordered_multimap<uint64_t, std::weak_ptr<MemoryPage> > pages;
+
+        void release(uint64_t hash, MemoryPage* page);
+    public:
+        static SharedPagePool& instance();
+
+        // the pooled page with the same content as the given one, it's added to the pool if there's none
+        std::shared_ptr<MemoryPage> intern(const MemoryPage& page);
+        size_t size();
+};
+
+template <typename Addr>
 class MemoryRange{
     private:
         std::string name;
@@ -36,50 +117,255 @@ class MemoryRange{
         bool writeable;
         bool executable;
         bool special;
-        uint16_t start;
-        uint16_t end;
-        std::unordered_map<uint16_t, uint8_t> memory;
+        Addr start;
+        Addr end;
+        // page number (address >> PAGE_SHIFT) -> page, sparse for any address width
+        std::unordered_map<Addr, std::shared_ptr<MemoryPage> > pages;
+        // pages that are not faulted in yet, page number -> serialized page record in a mapped file
+        std::unordered_map<Addr, const uint8_t*> lazy_pages;
+        // keeps the mapping of lazy_pages alive
+        std::shared_ptr<const void> lazy_owner;
+        // external page storage, gives the slot of a page number, taken on the first request; empty = heap
+        std::function<MemoryPage*(Addr)> slots;
+
+        MemoryPage* getPage(Addr page_no, bool create);
+        std::shared_ptr<MemoryPage> newPage(Addr page_no, const MemoryPage* copy);
     public:
-        MemoryRange(uint16_t start, uint16_t end, uint8_t mode, const std::string &name) :
+        MemoryRange(Addr start, Addr end, uint8_t mode, const std::string &name) :
             name(name),
             readable(mode & 0x4),
             writeable(mode & 0x2),
             executable(mode & 0x1),
             special(mode & 0x8),
             start(start),
-            end(end)
+            end(end),
+            slots()
             {};
             
 
-        uint16_t getStart();
-        uint16_t getEnd();
+        Addr getStart();
+        Addr getEnd();
         std::string getName() {return name;};
+        // access mode in the loader's format: special, readable, writeable, executable bits
+        uint8_t getMode();
 
-        void access(MemoryTransaction *req);
-        void directAccess(MemoryTransaction *req);
-        void checkAccessPermissions(MemoryTransaction *req);
+        virtual void access(MemoryTransaction<Addr> *req);
+        void directAccess(MemoryTransaction<Addr> *req);
+        void checkAccessPermissions(MemoryTransaction<Addr> *req);
+
+        // bulk accesses of [addr, addr + len) with no respect to permissions, a page at a time
+        void readBlock(Addr addr, uint8_t *buf, size_t len);
+        void writeBlock(Addr addr, const uint8_t *buf, size_t len);
+        void fillBlock(Addr addr, uint8_t value, size_t len);
 
         void memoryDump();
 
+        // checkpointing support, the numbers of all the populated (or lazily attached) pages
+        std::vector<Addr> getPageNumbers();
+        MemoryPage* getPopulatedPage(Addr page_no) {return getPage(page_no, false);};
+        // the page is read from the record on the first access to it
+        void attachLazyPage(Addr page_no, const uint8_t *record, std::shared_ptr<const void> owner);
+        // replace all the pages with the pooled ones, the pages written afterwards are copied on write
+        void sharePages();
+        // keep the pages in the slots of the given storage (see ShmSegment) from now on, the existing ones
+        // are moved there. The storage may throw std::domain_error if it's out of slots
+        void bindStorage(const std::function<MemoryPage*(Addr)>& slots);
+
         inline uint8_t getUninitMem();
 
-        ~MemoryRange();
+        virtual ~MemoryRange();
+};
+
+// there's no pending device event
+const uint64_t NO_EVENT = UINT64_MAX;
+
+template <typename Addr>
+class IoEvent{
+    public:
+        // core cycle the event happens at
+        uint64_t time;
+        // device register, its new value and size (a word)
+        Addr addr;
+        uint32_t value;
+        uint8_t size;
+        // scheduling order, the events of the same cycle fire in it
+        uint64_t seq;
+
+        IoEvent(uint64_t time, Addr addr, uint32_t value, uint8_t size) : time(time), addr(addr), value(value), size(size), seq(0) {};
+
+        bool operator>(const IoEvent& other) const {return time > other.time || (time == other.time && seq > other.seq);};
+
+        ~IoEvent() {};
 };
 
+// DMA device registers, a word each, register i is at AddressSpace<Addr>::dma_base + i * (word size)
+const uint8_t DMA_SRC = 0;
+const uint8_t DMA_DST = 1;
+const uint8_t DMA_LEN = 2;
+// memset byte (the low one) and compare result
+const uint8_t DMA_VALUE = 3;
+// written by the guest to start an operation
+const uint8_t DMA_CMD = 4;
+const uint8_t DMA_STATUS = 5;
+
+// DMA commands: copy LEN bytes from SRC to DST (overlapping is fine), fill LEN bytes at DST with VALUE,
+// compare LEN bytes at SRC and DST, VALUE is set to the number of the equal leading bytes
+const uint32_t DMA_MEMCPY = 1;
+const uint32_t DMA_MEMSET = 2;
+const uint32_t DMA_COMPARE = 3;
+// DMA status: no operation yet, done, permission or range failure or a block in the i/o range (nothing is done then),
+// unknown command
+const uint32_t DMA_IDLE = 0;
+const uint32_t DMA_DONE = 1;
+const uint32_t DMA_FAULT = 2;
+const uint32_t DMA_BAD_COMMAND = 3;
+
+template <typename Addr>
+class Memory;
 
+/*
+ * The special i/o range, devices in it have a notion of time: their events are queued by the core cycle
+ * they happen at and update the device registers once the core gets there.
+ * Device register reads have no side effects.
+ * The DMA device runs bulk memory operations on the host: a guest write to its command register does
+ * the whole operation before the write completes, the core is stalled for a cycle per word of the length.
+ * The device doesn't access the i/o range, the device registers included
+ */
+template <typename Addr>
+class IoRange : public MemoryRange<Addr>{
+    private:
+        std::priority_queue<IoEvent<Addr>, std::vector<IoEvent<Addr> >, std::greater<IoEvent<Addr> > > events;
+        // number of events fired and scheduled so far
+        uint64_t fired;
+        uint64_t scheduled;
+        // memory the DMA device works on, nullptr = no DMA device
+        Memory<Addr> *dma_memory;
+        // size of the DMA registers
+        uint8_t dma_word;
+        // an operation is running, the command register writes are ignored
+        bool dma_busy;
+
+        uint32_t readDmaRegister(uint8_t reg);
+        void writeDmaRegister(uint8_t reg, uint32_t value);
+        bool touches(Addr addr, Addr len);
+        void runDma();
+    public:
+        IoRange(Addr start, Addr end, uint8_t mode, const std::string &name) :
+            MemoryRange<Addr>(start, end, mode, name),
+            fired(0),
+            scheduled(0),
+            dma_memory(nullptr),
+            dma_word(0),
+            dma_busy(false)
+            {};
+
+        void access(MemoryTransaction<Addr> *req) override;
+        // enable the DMA device with registers of word_size bytes
+        void bindDma(Memory<Addr>* memory, uint8_t word_size) {dma_memory = memory; dma_word = word_size;};
+
+        void scheduleEvent(const IoEvent<Addr>& event);
+        uint64_t nextEventTime() {return events.empty() ? NO_EVENT : events.top().time;};
+        uint64_t getFiredCount() {return fired;};
+        // fire all the events due by the given time
+        void advance(uint64_t now);
+        // pending events in the order they happen, for checkpointing
+        std::vector<IoEvent<Addr> > getEvents();
+
+        ~IoRange() {};
+};
+
+// creates the range class matching the mode, i.e. IoRange for special ranges
+template <typename Addr>
+MemoryRange<Addr>* newMemoryRange(Addr start, Addr end, uint8_t mode, const std::string &name);
+
+
+// watchpoint kinds, breakpoints are instruction fetch watchpoints
+const uint8_t WATCH_READ = 0x1;
+const uint8_t WATCH_WRITE = 0x2;
+const uint8_t WATCH_EXEC = 0x4;
+
+template <typename Addr>
+class Watchpoint{
+    public:
+        Addr lo;
+        Addr hi;
+        uint8_t kind;
+
+        Watchpoint(Addr lo, Addr hi, uint8_t kind) : lo(lo), hi(hi), kind(kind) {};
+
+        ~Watchpoint() {};
+};
+
+template <typename Addr>
+class WatchHit{
+    public:
+        // the triggered watchpoint kind and the access itself
+        uint8_t kind;
+        Addr addr;
+        uint8_t size;
+        // memory content before and after the access, the same values for reads
+        uint32_t old_value;
+        uint32_t new_value;
+
+        WatchHit() : kind(0), addr(0), size(0), old_value(0), new_value(0) {};
+
+        ~WatchHit() {};
+};
+
+template <typename Addr>
 class Memory{
     private:
-        std::vector<MemoryRange*> memranges;
+        std::vector<MemoryRange<Addr>*> memranges;
         // an array of [(x.start, x.end) for x in memranges]
-        std::vector< std::pair<int, int> > bounds;
+        std::vector< std::pair<Addr, Addr> > bounds;
+        // page trap bits, indexed by page number. Only the accesses to flagged pages look through
+        // the watchpoints, empty while there're no watchpoints at all
+        std::vector<uint8_t> traps;
+        bool trapping;
+        bool exec_trapping;
+        std::vector<Watchpoint<Addr> > watchpoints;
+        WatchHit<Addr> hit;
+        bool hit_pending;
+        // core cycles the devices have stalled the core for by the last access
+        uint64_t stall_cycles;
+
+        void trappedAccess(MemoryRange<Addr>* range, MemoryTransaction<Addr> *req);
+        // the range holding all of [addr, addr + len), checked for the access kind
+        MemoryRange<Addr>* blockRange(Addr addr, Addr len, bool iswrite);
+        bool isTrapped(Addr addr, Addr len);
     public:
-        Memory() {};
+        Memory() : trapping(false), exec_trapping(false), hit_pending(false), stall_cycles(0) {};
 
-        int registerMemoryRange(MemoryRange* range);
-        int unregisterMemoryRange(MemoryRange* range);
-        MemoryRange* getRangeByName(std::string name);
+        int registerMemoryRange(MemoryRange<Addr>* range);
+        int unregisterMemoryRange(MemoryRange<Addr>* range);
+        MemoryRange<Addr>* getRangeByName(std::string name);
+        MemoryRange<Addr>* getRangeByAddr(Addr addr);
+        // registered ranges in the order of registration
+        const std::vector<MemoryRange<Addr>*>& getRanges() {return memranges;};
+        // move the pages of the ranges the guest doesn't normally write (code, cdata, smc) to the shared pool
+        void shareReadOnlyPages();
 
-        void access(MemoryTransaction *req);
+        void access(MemoryTransaction<Addr> *req);
+
+        // bulk operations of the DMA device, the permissions are checked as for the accesses of every byte,
+        // and the watchpoints are looked through the same way, nothing is done if any byte isn't accessible
+        void copy(Addr dst, Addr src, Addr len);
+        void fill(Addr dst, uint8_t value, Addr len);
+        // the number of the equal leading bytes
+        Addr compare(Addr src, Addr dst, Addr len);
+        // a device keeps the accessing core busy for the given number of cycles
+        void stall(uint64_t cycles) {stall_cycles += cycles;};
+        // the stall cycles are taken by the core
+        uint64_t takeStallCycles() {uint64_t taken = stall_cycles; stall_cycles = 0; return taken;};
+        // LDM/STM: count words of the given size in one transaction, words[i] is the word at addr + i * size
+        void burst(Addr addr, uint32_t *words, uint8_t count, uint8_t size, bool iswrite);
+
+        void addWatchpoint(Addr lo, Addr hi, uint8_t kind);
+        // trap bits of all the pages if there're breakpoints, nullptr otherwise
+        const uint8_t* getExecTraps() {return exec_trapping ? traps.data() : nullptr;};
+        // a watchpoint has been hit by the last access, the access itself is complete
+        bool hasWatchHit() {return hit_pending;};
+        const WatchHit<Addr>& getWatchHit() {return hit;};
 
         void memoryDump();
 
@@ -87,32 +373,107 @@ class Memory{
 };
 
 
+// revision of the instruction set: the encodings, their semantics and the verifier rules.
+// Bump it on any change of them, the verifier results cached by the older revisions are not used then
+const uint8_t ISA_REVISION = 2;
+
+template <typename Addr, typename Word>
 class Core{
     private:
+        typedef typename std::make_signed<Word>::type SWord;
+        static const uint32_t WORD_BITS = sizeof(Word) * 8;
+
         // instruction pointer - next instruction to fetch
         // and since there's no pipeline (nor instruction buffer) - to decode and execute too
-        uint16_t ip;
+        Addr ip;
         // fetch stage result
         // actually, if for some reason I decided to make more pseudo-stages, 
         // it would be better to keep here every intermediate cross-stage results
         uint32_t fetched_instr;
+        // address of the fetched instruction, ip moves on by the fetch
+        Addr fetched_ip;
+        // number of fetched instructions
+        uint64_t icount;
+        // core time, an instruction takes a cycle, plus a cycle for memory access by LD/ST, a cycle per word by LDM/STM,
+        // plus the cycles the stores to the devices stall the core for
+        uint64_t cycles;
         // associated memory
-        Memory *memory;
-        // register file
-        std::array<uint16_t, 16> reg;
+        Memory<Addr> *memory;
+        // register file, kept in reg_storage unless it's bound to an external storage
+        std::array<Word, 16> reg_storage;
+        Word *reg;
         // logging is enabled = verbose execution
         bool log_en;
+        // code proven by the load-time verifier, fetched directly, with no memory routing and permission checks
+        // covers [verified_start, verified_end), everything outside is fetched the checked way
+        const std::vector<uint32_t> *verified_code;
+        Addr verified_start;
+        Addr verified_end;
+        // page trap bits of the memory, breakpoints shall not be skipped by the fast fetches
+        const uint8_t *exec_traps;
+        // devices the idle loops wait for, nullptr = no idle loops fast-forward
+        IoRange<Addr> *io;
+        // idle loop detection state, taken at the last backward branch: its destination, the register file
+        // and the counters. A loop iteration with no stores, no device events and no register changes
+        // can only be ended by an i/o event
+        Addr loop_head;
+        std::array<Word, 16> loop_reg;
+        uint64_t loop_icount;
+        uint64_t loop_cycles;
+        uint64_t loop_events;
+        bool loop_stores;
+
+        void checkIdleLoop(Addr dst);
     public:
         // code entry point is set up in the constructor
-        Core(uint16_t ip, bool log_en) : ip(ip), fetched_instr(0xffffffff), reg({0}), log_en(log_en) {};
+        Core(Addr ip, bool log_en) :
+            ip(ip),
+            fetched_instr(0xffffffff),
+            fetched_ip(ip),
+            icount(0),
+            cycles(0),
+            reg_storage({0}),
+            reg(reg_storage.data()),
+            log_en(log_en),
+            verified_code(nullptr),
+            verified_start(0),
+            verified_end(0),
+            exec_traps(nullptr),
+            io(nullptr),
+            loop_head(0),
+            loop_reg({0}),
+            loop_icount(0),
+            loop_cycles(0),
+            loop_events(0),
+            loop_stores(true)
+            {};
+        // the register file may be bound to an external storage
+        Core(const Core&) = delete;
+        Core& operator=(const Core&) = delete;
         
-        void bindMemory(Memory* memory);
+        void bindMemory(Memory<Addr>* memory);
+        void bindVerifiedCode(Addr start, const std::vector<uint32_t>* code);
+        // enables fast-forward of the loops polling the i/o range
+        void bindIo(IoRange<Addr>* io) {this->io = io;};
+        // keep the register file in the given storage of 16 words from now on, the registers are copied there
+        void bindRegisters(Word *storage);
 
         void fetch();
         int execute();
 
         // jumps to an instruction
-        void jump(uint16_t dst) {ip = dst;};
+        void jump(Addr dst) {ip = dst;};
+        // takes the fetched instruction back as if it has never been fetched, e.g. at a breakpoint
+        void unfetch() {ip = fetched_ip; icount--;};
+
+        // architectural state access for checkpointing
+        Addr getIp() {return ip;};
+        uint32_t getFetchedInstr() {return fetched_instr;};
+        Addr getFetchedIp() {return fetched_ip;};
+        uint64_t getInstrCount() {return icount;};
+        uint64_t getCycles() {return cycles;};
+        std::array<Word, 16> getRegFile();
+        void restoreState(uint32_t fetched_instr, uint64_t icount, uint64_t cycles, const std::array<Word, 16>& reg);
 
         void printRegFile();
 
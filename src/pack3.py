@@ -0,0 +1,56 @@
+import sys
+
+# Builds a Toy3 image (see simul.cpp) out of section data files:
+#   pack3.py <out> <width> <name>:<start>:<end>:<mode>[:<file>[:rle]] ...
+# width is 2 or 4, the file content is loaded at the section start, 'rle' stores it PackBits-compressed
+# e.g. pack3.py input 2 code:0x4:0xff:5:code.bin data:0x100:0xefff:6:data.bin:rle
+
+def packbits(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        run = 1
+        while i + run < len(data) and run < 128 and data[i + run] == data[i]:
+            run += 1
+        if run > 1:
+            out += bytes([257 - run, data[i]])
+            i += run
+            continue
+        # literal bytes up to the next run of 2 equal ones
+        j = i + 1
+        while j < len(data) and j - i < 128 and not (j + 1 < len(data) and data[j] == data[j + 1]):
+            j += 1
+        out += bytes([j - i - 1]) + data[i:j]
+        i = j
+    return bytes(out)
+
+width = int(sys.argv[2], 0)
+if width not in (2, 4):
+    raise ValueError("width shall be 2 or 4")
+
+def field(value, size):
+    if value >= 2**(8*size):
+        raise ValueError("value 0x%x doesn't fit in %d bytes" % (value, size))
+    return bytes([(value >> (8*i)) & 0xff for i in reversed(range(size))])
+
+sections = []
+for arg in sys.argv[3:]:
+    parts = arg.split(':')
+    name, start, end, mode = parts[0], int(parts[1], 0), int(parts[2], 0), int(parts[3], 0)
+    data = open(parts[4], 'rb').read() if len(parts) > 4 else b''
+    rle = len(parts) > 5 and parts[5] == 'rle'
+    sections.append((name.encode(), start, end, mode, rle, data, packbits(data) if rle else data))
+
+table_size = 4 + 1 + 2 + sum(1 + len(s[0]) + 2*width + 2 + 8 + width for s in sections)
+table = bytearray(b'Toy3') + field(width, 1) + field(len(sections), 2)
+offset = table_size
+for name, start, end, mode, rle, data, stored in sections:
+    table += field(len(name), 1) + name + field(start, width) + field(end, width) + field(mode, 1) + field(int(rle), 1)
+    table += field(offset, 4) + field(len(stored), 4) + field(len(data), width)
+    offset += len(stored)
+
+outf = open(sys.argv[1], 'wb')
+outf.write(table)
+for s in sections:
+    outf.write(s[6])
+outf.close()
@@ -0,0 +1,72 @@
+#ifndef SHMLAYOUT_H
+#define SHMLAYOUT_H
+#include <cstdint>
+
+/*
+ * Layout of the shared memory segment the simulator keeps the guest memory and the register file in
+ * ("shm <name>" option, the segment is /dev/shm/<name>). The segment is written by the simulation
+ * thread as it goes, with no synchronization: a reader samples it, a value being updated may be torn.
+ * All the fields are in the host byte order, offsets are from the segment start.
+ *
+ *   ShmHeader                      at 0
+ *   register file                  at regs_offset, 16 words of word_size bytes, r0 first
+ *   page directory of every range  at ShmRange::dir_offset, ShmRange::pages entries of 4 bytes
+ *   page slots                     at slots_offset, ShmPage each, slots_used of them are taken
+ *
+ * A range has a directory entry for every page number it covers, the first entry is the page of the range
+ * start (address >> SHM_PAGE_SHIFT). An entry is 0 if the page has no slot, i.e. the guest has never touched it
+ * and all its bytes are invalid (read as uninitialized memory, 0xff), the slot index + 1 otherwise.
+ * The slots are taken in the order the pages are touched, so the segment is sparse: only the slots taken
+ * and the directory parts in use take memory
+ */
+const char SHM_MAGIC[4] = {'T', 'S', 'H', 'M'};
+const uint16_t SHM_VERSION = 2;
+const uint32_t SHM_PAGE_SHIFT = 8;
+const uint32_t SHM_PAGE_SIZE = 1 << SHM_PAGE_SHIFT;
+const uint32_t SHM_MAX_RANGES = 16;
+const uint32_t SHM_NAME_SIZE = 16;
+
+struct ShmPage{
+    uint8_t data[SHM_PAGE_SIZE];
+    // bit (i & 7) of valid[i >> 3] is set if data[i] has ever been written
+    uint8_t valid[SHM_PAGE_SIZE / 8];
+    // the page content is shared with other ranges, it's copied to the slot on the first write
+    uint8_t shared;
+    uint8_t reserved[7];
+};
+
+struct ShmRange{
+    // zero-terminated
+    char name[SHM_NAME_SIZE];
+    uint64_t start;
+    uint64_t end;
+    uint64_t dir_offset;
+    // number of the directory entries, the pages the range covers
+    uint64_t pages;
+    // special, readable, writeable, executable bits, as in the loader
+    uint8_t mode;
+    uint8_t reserved[7];
+};
+
+struct ShmHeader{
+    char magic[4];
+    uint16_t version;
+    // address and word (register) sizes in bytes
+    uint8_t addr_size;
+    uint8_t word_size;
+    uint32_t page_size;
+    // sizeof(ShmPage)
+    uint32_t page_slot_size;
+    uint32_t ranges;
+    uint32_t reserved;
+    uint64_t regs_offset;
+    uint64_t slots_offset;
+    // the slots there's room for and the slots taken so far
+    uint64_t slots;
+    uint64_t slots_used;
+    // of the whole segment
+    uint64_t size;
+    ShmRange range[SHM_MAX_RANGES];
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "shmsegment.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/mman.h>
+
+// the pages are used in the slots as they are, so the layouts must match
+static_assert(PAGE_SIZE == SHM_PAGE_SIZE, "page size mismatch");
+static_assert(sizeof(MemoryPage) == sizeof(ShmPage), "MemoryPage doesn't match ShmPage");
+static_assert(offsetof(MemoryPage, valid) == offsetof(ShmPage, valid), "MemoryPage doesn't match ShmPage");
+static_assert(offsetof(MemoryPage, shared) == offsetof(ShmPage, shared), "MemoryPage doesn't match ShmPage");
+
+// the segment memory is reserved in blocks of this size
+const uint32_t SHM_RESERVE_SHIFT = 16;
+const uint64_t SHM_RESERVE_SIZE = 1 << SHM_RESERVE_SHIFT;
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment){
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+/*
+ * Allocate the file system memory of the blocks holding [offset, offset + len), the writes there never fault then
+ */
+template <typename Addr, typename Word>
+int ShmSegment<Addr, Word>::reserve(uint64_t offset, uint64_t len){
+    for (uint64_t block = offset >> SHM_RESERVE_SHIFT; block <= (offset + len - 1) >> SHM_RESERVE_SHIFT; block++){
+        if (reserved[block])
+            continue;
+        uint64_t start = block << SHM_RESERVE_SHIFT;
+        if (posix_fallocate(fd, start, std::min(SHM_RESERVE_SIZE, (uint64_t)size - start)))
+            return 1;
+        reserved[block] = true;
+    }
+    return 0;
+}
+
+template <typename Addr, typename Word>
+MemoryPage* ShmSegment<Addr, Word>::slot(uint32_t range, Addr page_no){
+    ShmHeader *header = (ShmHeader*)base;
+    MemoryPage *slots = (MemoryPage*)(base + header->slots_offset);
+    uint64_t dir_entry = header->range[range].dir_offset + (page_no - (header->range[range].start >> SHM_PAGE_SHIFT)) * 4;
+    uint32_t *dir = (uint32_t*)(base + dir_entry);
+    // the directory part that is not reserved has no entries yet, it's not even read
+    if (reserved[dir_entry >> SHM_RESERVE_SHIFT] && *dir)
+        return &slots[*dir - 1];
+    uint64_t index = header->slots_used;
+    if (index == header->slots || reserve(dir_entry, 4) || reserve(header->slots_offset + index * sizeof(ShmPage), sizeof(ShmPage)))
+        throw std::domain_error("Shared memory segment " + name + " is out of memory");
+    header->slots_used = index + 1;
+    *dir = index + 1;
+    return &slots[index];
+}
+
+template <typename Addr, typename Word>
+int ShmSegment<Addr, Word>::create(const std::string& name, Memory<Addr>& memory, Core<Addr, Word>& core){
+    const std::vector<MemoryRange<Addr>*>& ranges = memory.getRanges();
+    if (ranges.size() > SHM_MAX_RANGES){
+        simOut() << "Too many memory ranges for a shared memory segment" << std::endl;
+        return 1;
+    }
+    // std::bitset has no defined layout, the readers expect the bits in the ascending order
+    MemoryPage probe;
+    probe.valid.set(9);
+    if (reinterpret_cast<const ShmPage*>(&probe)->valid[1] != 0x2){
+        simOut() << "Page validity bitmap layout is not supported by the shared memory segment" << std::endl;
+        return 1;
+    }
+
+    uint64_t regs_offset = alignUp(sizeof(ShmHeader), 64);
+    uint64_t offset = regs_offset + 16 * sizeof(Word);
+    std::vector<uint64_t> dir_offsets;
+    std::vector<uint64_t> pages;
+    uint64_t slots = 0;
+    for (auto it = ranges.begin(); it != ranges.end(); ++it){
+        offset = alignUp(offset, 64);
+        dir_offsets.push_back(offset);
+        pages.push_back(((*it)->getEnd() >> PAGE_SHIFT) - ((*it)->getStart() >> PAGE_SHIFT) + 1);
+        offset += pages.back() * 4;
+        slots += pages.back();
+    }
+    uint64_t slots_offset = alignUp(offset, 4096);
+    uint64_t segment_size = slots_offset + slots * sizeof(ShmPage);
+
+    // the name of a running simulation is not taken over
+    int fd = shm_open(("/" + name).c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0){
+        if (errno == EEXIST)
+            simOut() << "Shared memory segment " << name << " already exists" << std::endl;
+        else
+            simOut() << "Cannot create shared memory segment " << name << std::endl;
+        return 1;
+    }
+    // the untouched parts of the segment take no memory
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, segment_size) == 0)
+        map = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (map == MAP_FAILED){
+        simOut() << "Cannot map shared memory segment " << name << std::endl;
+        close(fd);
+        shm_unlink(("/" + name).c_str());
+        return 1;
+    }
+    // the segment is ours from now on, it's removed by the destructor
+    this->name = name;
+    this->fd = fd;
+    base = (uint8_t*)map;
+    size = segment_size;
+    reserved.assign(((size - 1) >> SHM_RESERVE_SHIFT) + 1, false);
+    if (reserve(0, regs_offset + 16 * sizeof(Word))){
+        simOut() << "Not enough memory for shared memory segment " << name << std::endl;
+        return 1;
+    }
+
+    ShmHeader *header = (ShmHeader*)base;
+    header->version = SHM_VERSION;
+    header->addr_size = sizeof(Addr);
+    header->word_size = sizeof(Word);
+    header->page_size = SHM_PAGE_SIZE;
+    header->page_slot_size = sizeof(ShmPage);
+    header->ranges = ranges.size();
+    header->regs_offset = regs_offset;
+    header->slots_offset = slots_offset;
+    header->slots = slots;
+    header->slots_used = 0;
+    header->size = size;
+    for (size_t i = 0; i < ranges.size(); i++){
+        ShmRange& range = header->range[i];
+        std::strncpy(range.name, ranges[i]->getName().c_str(), SHM_NAME_SIZE - 1);
+        range.start = ranges[i]->getStart();
+        range.end = ranges[i]->getEnd();
+        range.dir_offset = dir_offsets[i];
+        range.pages = pages[i];
+        range.mode = ranges[i]->getMode();
+    }
+    try{
+        for (uint32_t i = 0; i < ranges.size(); i++)
+            ranges[i]->bindStorage([this, i](Addr page_no){ return slot(i, page_no); });
+    }
+    catch (const std::domain_error& ex){
+        simOut() << ex.what() << std::endl;
+        return 1;
+    }
+    core.bindRegisters((Word*)(base + regs_offset));
+    // the segment is complete, readers may use it
+    std::memcpy(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    return 0;
+}
+
+template <typename Addr, typename Word>
+ShmSegment<Addr, Word>::~ShmSegment(){
+    if (base == nullptr)
+        return;
+    munmap(base, size);
+    close(fd);
+    shm_unlink(("/" + name).c_str());
+}
+
+template class ShmSegment<uint16_t, uint16_t>;
+template class ShmSegment<uint32_t, uint32_t>;
@@ -0,0 +1,40 @@
+#ifndef SHMSEGMENT_H
+#define SHMSEGMENT_H
+#include "models.h"
+#include "shmlayout.h"
+#include <string>
+#include <vector>
+
+/*
+ * Shared memory segment backing the memory ranges and the register file of a simulated machine,
+ * so that external monitors can read them live (see shmlayout.h and shmview.cpp).
+ * The segment is sparse, its memory is reserved a block at a time as the slots are taken, so a full
+ * file system fails the guest access that needs a new page rather than killing the simulator with SIGBUS.
+ * The segment is removed with the object, the readers that have it mapped keep their mapping
+ */
+template <typename Addr, typename Word>
+class ShmSegment{
+    private:
+        std::string name;
+        uint8_t *base;
+        size_t size;
+        int fd;
+        // the reserved blocks of SHM_RESERVE_SIZE bytes
+        std::vector<bool> reserved;
+
+        int reserve(uint64_t offset, uint64_t len);
+        // the slot of the page of the given range, taken on the first request
+        MemoryPage* slot(uint32_t range, Addr page_no);
+    public:
+        ShmSegment() : base(nullptr), size(0), fd(-1) {};
+        ShmSegment(const ShmSegment&) = delete;
+        ShmSegment& operator=(const ShmSegment&) = delete;
+
+        // create the segment /<name> for the registered ranges, the pages and the registers are moved there.
+        // An existing segment of the name (another simulation's one) is left alone, it's an error
+        int create(const std::string& name, Memory<Addr>& memory, Core<Addr, Word>& core);
+
+        ~ShmSegment();
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Read-only viewer of a running simulation, reads the shared memory segment of the simulator
+ * ("exec shm <name>") and prints the register file, the memory ranges and, given an address range,
+ * the written memory bytes in it. The simulation is not stopped, the values are a sample.
+ * The segment is read, not mapped: the holes of a sparse segment read as zeros and take no memory
+ *
+ *   shmview <name> [<lo>:<hi>]
+ */
+#include "shmlayout.h"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool readAt(int fd, uint64_t offset, void *buf, size_t len){
+    return pread(fd, buf, len, offset) == (ssize_t)len;
+}
+
+/*
+ * Print the valid bytes of the range within [lo, hi], the pages with no slot have none
+ */
+void dumpRange(int fd, const ShmHeader& header, const ShmRange& range, uint64_t lo, uint64_t hi){
+    uint64_t first = range.start > lo ? range.start : lo;
+    uint64_t last = range.end < hi ? range.end : hi;
+    for (uint64_t page_no = first >> SHM_PAGE_SHIFT; first <= last && page_no <= last >> SHM_PAGE_SHIFT; page_no++){
+        uint32_t entry = 0;
+        ShmPage page;
+        if (!readAt(fd, range.dir_offset + (page_no - (range.start >> SHM_PAGE_SHIFT)) * 4, &entry, 4) || !entry
+            || entry > header.slots || !readAt(fd, header.slots_offset + (entry - 1) * sizeof(ShmPage), &page, sizeof(page)))
+            continue;
+        uint64_t page_start = page_no << SHM_PAGE_SHIFT;
+        uint64_t addr = first > page_start ? first : page_start;
+        for (; addr <= last && addr < page_start + SHM_PAGE_SIZE; addr++){
+            uint32_t i = addr & (SHM_PAGE_SIZE - 1);
+            if ((page.valid[i >> 3] >> (i & 0x7)) & 0x1)
+                std::cout << "0x" << std::setfill('0') << std::setw(header.addr_size * 2) << std::hex << addr
+                          << ":  0x" << std::setfill('0') << std::setw(2) << std::hex << (uint32_t)page.data[i] << std::endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    if (argc < 2){
+        std::cout << "Usage: shmview <name> [<lo>:<hi>]" << std::endl;
+        return 1;
+    }
+    std::string name = argv[1];
+    bool dump = argc > 2;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    if (dump){
+        char *rest = nullptr;
+        lo = std::strtoull(argv[2], &rest, 0);
+        hi = *rest == ':' ? std::strtoull(rest + 1, &rest, 0) : lo;
+        if (*rest != '\0' || lo > hi){
+            std::cout << "Wrong address range " << argv[2] << std::endl;
+            return 1;
+        }
+    }
+
+    int fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+    if (fd < 0){
+        std::cout << "Cannot open shared memory segment " << name << std::endl;
+        return 1;
+    }
+    struct stat st;
+    ShmHeader header;
+    if (fstat(fd, &st) || !readAt(fd, 0, &header, sizeof(header))){
+        std::cout << "Wrong shared memory segment " << name << std::endl;
+        close(fd);
+        return 1;
+    }
+    if (std::memcmp(header.magic, SHM_MAGIC, sizeof(SHM_MAGIC)) || header.version != SHM_VERSION
+        || header.page_size != SHM_PAGE_SIZE || header.page_slot_size != sizeof(ShmPage)
+        || header.size != (uint64_t)st.st_size || header.ranges > SHM_MAX_RANGES
+        || header.slots_offset + header.slots * sizeof(ShmPage) > header.size){
+        std::cout << "Shared memory segment " << name << " is not ready or has an unsupported layout" << std::endl;
+        close(fd);
+        return 1;
+    }
+
+    std::cout << "-====== Register File ======-" << std::endl;
+    uint32_t regs[16] = {0};
+    uint16_t regs16[16] = {0};
+    if (header.word_size == 2 ? !readAt(fd, header.regs_offset, regs16, sizeof(regs16)) : !readAt(fd, header.regs_offset, regs, sizeof(regs))){
+        std::cout << "Cannot read the register file" << std::endl;
+        close(fd);
+        return 1;
+    }
+    for (uint32_t i = 0; i < 16; i++){
+        uint64_t value = header.word_size == 2 ? regs16[i] : regs[i];
+        std::cout << "r" << std::dec << i
+                  << ":  0x" << std::setfill('0') << std::setw(header.word_size * 2) << std::hex << value << std::endl;
+    }
+    std::cout << "-===========================-" << std::endl;
+    std::cout << "Pages in use: " << std::dec << header.slots_used << std::endl;
+
+    for (uint32_t i = 0; i < header.ranges; i++){
+        const ShmRange& range = header.range[i];
+        std::cout << "=== " << std::string(range.name, strnlen(range.name, SHM_NAME_SIZE)) << " === 0x"
+                  << std::setfill('0') << std::setw(header.addr_size * 2) << std::hex << range.start << "-0x"
+                  << std::setfill('0') << std::setw(header.addr_size * 2) << std::hex << range.end
+                  << ", mode " << std::dec << (uint32_t)range.mode << std::endl;
+        if (range.dir_offset + range.pages * 4 > header.slots_offset){
+            std::cout << "The range is out of the segment" << std::endl;
+            continue;
+        }
+        if (dump)
+            dumpRange(fd, header, range, lo, hi);
+    }
+    close(fd);
+    return 0;
+}
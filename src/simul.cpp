@@ -1,25 +1,33 @@
 #include "simul.h"
 #include "models.h"
+#include "checkpoint.h"
+#include "imagecache.h"
+#include "shmsegment.h"
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <vector>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 /*
- * Read 2 bytes from a file
+ * Read an address-sized (2 bytes for Toy1, 4 bytes for Toy2) big-endian field from a file
  */
-int readParam(std::ifstream& infile, uint16_t& param){
+template <typename Addr>
+int readParam(std::ifstream& infile, Addr& param){
     char byte;
-    if (infile.get(byte)){
-        param = (uint16_t)byte << 8;
-    }
-    else{
-        return 1;
-    }
-    if (infile.get(byte)){
-        param |= (uint16_t)byte;
-    }
-    else{
-        return 1;
+    param = 0;
+    for (size_t i = 0; i < sizeof(Addr); i++){
+        if (infile.get(byte)){
+            param = (Addr)(param << 8) | (uint8_t)byte;
+        }
+        else{
+            return 1;
+        }
     }
     return 0;
 }
@@ -27,20 +35,23 @@ int readParam(std::ifstream& infile, uint16_t& param){
 /*
  * Read a section from a file and write data to a corresponding memory region
  */
-int loadMemoryRange(std::ifstream& infile, Memory& memory,const std::string name, uint16_t size){
-    uint16_t addr = 0;
+template <typename Addr>
+int loadMemoryRange(std::ifstream& infile, Memory<Addr>& memory,const std::string name, Addr size){
+    Addr addr = 0;
     char byte = 0;
-    uint16_t cnt = 0;
+    Addr cnt = 0;
 
-    MemoryRange* range = memory.getRangeByName(name);
+    MemoryRange<Addr>* range = memory.getRangeByName(name);
     if (range == nullptr){
         return 1;
     }
     addr = range->getStart();
-    MemoryTransaction req = MemoryTransaction(addr, (uint32_t*)&byte, 1, 0, 1);
+    uint32_t buf = 0;
+    MemoryTransaction<Addr> req = MemoryTransaction<Addr>(addr, &buf, 1, 0, 1);
     // read and write to memory byte by byte because why not, overall size is not that big anyways
     while (cnt < size){
         if (infile.get(byte)){
+            buf = (uint8_t)byte;
             req.addr = addr;
             range->directAccess(&req);
             addr++;
@@ -56,22 +67,57 @@ int loadMemoryRange(std::ifstream& infile, Memory& memory,const std::string name
 }
 
 /*
- * Parse the given binary file and fill the simulator data classes accordingly
+ * Image header, the section fields are address-sized
  */
-int parseInput(Memory& memory, bool DEBUG){
+template <typename Addr>
+std::string imageHeader(){
+    return sizeof(Addr) == 2 ? "Toy1" : "Toy2";
+}
+
+/*
+ * Print the loader fields of the image
+ */
+template <typename Addr>
+void printLayout(const ImageLayout<Addr>& layout){
+    if (layout.header == "Toy3"){
+        simOut() << " header   = "   << layout.header << std::endl
+                 << " code_sz  = "   << std::dec << layout.code_sz << std::endl;
+        for (auto it = layout.sections.begin(); it != layout.sections.end(); ++it)
+            simOut() << " section  = " << it->name << " 0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << it->start
+                     << "-0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << it->end
+                     << ", mode " << std::dec << (uint32_t)it->mode << std::endl;
+        return;
+    }
+    simOut() << " header   = "   << layout.header << std::endl
+              << " code_sz  = "   << std::dec << layout.code_sz  << std::endl
+              << " cdata    = 0x" << std::hex << layout.cdata    << std::endl
+              << " cdata_sz = "   << std::dec << layout.cdata_sz << std::endl
+              << " smc      = 0x" << std::hex << layout.smc      << std::endl
+              << " data     = 0x" << std::hex << layout.data     << std::endl
+              << " data_sz  = "   << std::dec << layout.data_sz  << std::endl
+              << " mem      = 0x" << std::hex << layout.mem      << std::endl
+              << " dbg_sz   = "   << std::dec << layout.dbg_sz   << std::endl;
+}
+
+/*
+ * Read the header and the loader fields of the image, validate them and describe the memory ranges.
+ * The file is left at the first section data
+ */
+template <typename Addr>
+int readLayout(std::ifstream& infile, ImageLayout<Addr>& layout, bool DEBUG){
     char byte;
     uint32_t index = 0;
     int ret = 0;
-    char header[4] = {0};
-    std::ifstream infile("input", std::ios::binary);
-    uint16_t code_sz = 0;
-    uint16_t cdata = 0;
-    uint16_t cdata_sz = 0;
-    uint16_t smc = 0;
-    uint16_t data = 0;
-    uint16_t data_sz = 0;
-    uint16_t mem = 0;
-    uint16_t dbg_sz = 0;
+    char header[5] = {0};
+    Addr& code_sz = layout.code_sz;
+    Addr& cdata = layout.cdata;
+    Addr& cdata_sz = layout.cdata_sz;
+    Addr& smc = layout.smc;
+    Addr& data = layout.data;
+    Addr& data_sz = layout.data_sz;
+    Addr& mem = layout.mem;
+    Addr& dbg_sz = layout.dbg_sz;
+    const Addr io_base = AddressSpace<Addr>::io_base;
 
 
     // reading the filetype=header string
@@ -84,13 +130,13 @@ int parseInput(Memory& memory, bool DEBUG){
             break;
         }
     }
-    if ((header[0] != 'T') || (header[1] != 'o') || (header[2] != 'y') || (header[3] != '1') || (index != 4)){
-        std::cout << "Wrong input file format =" << header << std::endl;
-        infile.close();
+    if (imageHeader<Addr>() != header || (index != 4)){
+        simOut() << "Wrong input file format =" << header << std::endl;
         return 1;
     }
+    layout.header = header;
 
-    // read 8 control fields 2 bytes each
+    // read 8 control fields, address-sized each
     ret += readParam(infile, code_sz);
     ret += readParam(infile, cdata);
     ret += readParam(infile, cdata_sz);
@@ -100,35 +146,23 @@ int parseInput(Memory& memory, bool DEBUG){
     ret += readParam(infile, mem);
     ret += readParam(infile, dbg_sz);
     if (ret != 0){
-        infile.close();
-        std::cout << "Control section cannot be read" << std::endl;
+        simOut() << "Control section cannot be read" << std::endl;
         return 1;
     }
 
     // look what we've read so far
-    if (DEBUG){
-        std::cout << " header   = "   << header << std::endl
-                  << " code_sz  = "   << std::dec << code_sz  << std::endl
-                  << " cdata    = 0x" << std::hex << cdata    << std::endl
-                  << " cdata_sz = "   << std::dec << cdata_sz << std::endl
-                  << " smc      = 0x" << std::hex << smc      << std::endl
-                  << " data     = 0x" << std::hex << data     << std::endl
-                  << " data_sz  = "   << std::dec << data_sz  << std::endl
-                  << " mem      = 0x" << std::hex << mem      << std::endl
-                  << " dbg_sz   = "   << std::dec << dbg_sz   << std::endl;
-    }
+    if (DEBUG)
+        printLayout(layout);
 
     // sanity and parameters pre-requirements check
 
     // non-zero code section, shall 4-bytes aligned
     if (code_sz == 0){
-        std::cout << "code_sz cannot be zero" << std::endl;
-        infile.close();
+        simOut() << "code_sz cannot be zero" << std::endl;
         return 1;
     }
     if (code_sz % 4){
-        std::cout << "code_sz shall be 4-bytes aligned" << std::endl;
-        infile.close();
+        simOut() << "code_sz shall be 4-bytes aligned" << std::endl;
         return 1;
     }
 
@@ -140,224 +174,658 @@ int parseInput(Memory& memory, bool DEBUG){
 
     // sanity check
     if (!cdata_nz && cdata_sz != 0){
-        std::cout << "cdata_sz cannot be non-zero for cdata = 0" << std::endl;
-        infile.close();
+        simOut() << "cdata_sz cannot be non-zero for cdata = 0" << std::endl;
         return 1;
     }
     if (!data_nz && data_sz != 0){
-        std::cout << "data_sz cannot be non-zero for data = 0" << std::endl;
-        infile.close();
+        simOut() << "data_sz cannot be non-zero for data = 0" << std::endl;
         return 1;
     }
 
     // check for monotonous section address raise
     if (smc_nz){
         if (smc <= cdata){
-            std::cout << "smc must be > cdata" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "smc must be > cdata" << std::endl;
+                return 1;
         }
     }
     if (data_nz){
         if (data <= smc){
-            std::cout << "data must be > smc" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "data must be > smc" << std::endl;
+                return 1;
         }
         if (data <= cdata){
-            std::cout << "data must be > cdata" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "data must be > cdata" << std::endl;
+                return 1;
         }
     }
     if (mem_nz){
         if (mem <= data){
-            std::cout << "mem must be > data" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "mem must be > data" << std::endl;
+                return 1;
         }
         if (mem <= smc){
-            std::cout << "mem must be > smc" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "mem must be > smc" << std::endl;
+                return 1;
         }
         if (mem <= cdata){
-            std::cout << "mem must be > cdata" << std::endl;
-            infile.close();
-            return 1;
+            simOut() << "mem must be > cdata" << std::endl;
+                return 1;
         }
     }
 
     // check section sizes and their representaions in the file
-    uint16_t section_data_size = 0;
-    uint16_t section_code_size = 0;
-    uint16_t section_cdata_size = 0;
+    Addr section_data_size = 0;
+    Addr section_code_size = 0;
+    Addr section_cdata_size = 0;
     
-    section_data_size = mem_nz ? mem - data : 0xf000 - data;
-    section_cdata_size = smc_nz ? smc - cdata : data_nz ? data - cdata : mem_nz ? mem - cdata : 0xf000 - cdata;
-    section_code_size = cdata_nz ? cdata - 4 : smc_nz ? smc - 4 : data_nz ? data - 4 : mem_nz ? mem - 4 : 0xeffc;
+    section_data_size = mem_nz ? mem - data : io_base - data;
+    section_cdata_size = smc_nz ? smc - cdata : data_nz ? data - cdata : mem_nz ? mem - cdata : io_base - cdata;
+    section_code_size = cdata_nz ? cdata - 4 : smc_nz ? smc - 4 : data_nz ? data - 4 : mem_nz ? mem - 4 : io_base - 4;
 
     if (section_data_size < data_sz){
-        std::cout << "data_sz is more than the actual section size = " << section_data_size << std::endl;
-        infile.close();
+        simOut() << "data_sz is more than the actual section size = " << section_data_size << std::endl;
         return 1;
     }
 
     if (section_code_size < code_sz){
-        std::cout << "code_sz is more than the actual code size = " << section_code_size << std::endl;
-        infile.close();
+        simOut() << "code_sz is more than the actual code size = " << section_code_size << std::endl;
         return 1;
     }
 
     if (section_cdata_size < cdata_sz){
-        std::cout << "cdata_sz is more than the actual section size = " << section_cdata_size << std::endl;
-        infile.close();
+        simOut() << "cdata_sz is more than the actual section size = " << section_cdata_size << std::endl;
         return 1;
     }
 
 
 
     // as we've got to this point, everyting shall be correct
-    // create described memory regions and add them to the memory map
-    ret = 0;
-    uint16_t border_hi = 0xffff;
-    MemoryRange* range;
+    // describe the memory regions, in the order they're added to the memory map
+    Addr border_hi = AddressSpace<Addr>::last;
+    std::vector<SectionDesc<Addr> >& sections = layout.sections;
+    sections.clear();
 
     // I/O section
-    range = new MemoryRange(0xf000, border_hi, 8, "i/o");
-    ret += memory.registerMemoryRange(range);
-    border_hi = 0xefff;
+    sections.push_back(SectionDesc<Addr>("i/o", io_base, border_hi, 8));
+    border_hi = io_base - 1;
 
     // heap section
     if (mem_nz){
-        range = new MemoryRange(mem, 0xefff, 6, "heap");
-        ret += memory.registerMemoryRange(range);
+        sections.push_back(SectionDesc<Addr>("heap", mem, io_base - 1, 6));
         border_hi = mem - 1;
     }
 
     // data section
     if (data_nz){
-        range = new MemoryRange(data, border_hi, 6, "data");
-        ret += memory.registerMemoryRange(range);
+        sections.push_back(SectionDesc<Addr>("data", data, border_hi, 6));
         border_hi = data - 1;
     }
 
     // aux code section
     if (smc_nz){
-        range = new MemoryRange(smc, border_hi, 7, "smc");
-        ret += memory.registerMemoryRange(range);
+        sections.push_back(SectionDesc<Addr>("smc", smc, border_hi, 7));
         border_hi = smc - 1;
     }
 
     // constant data section
     if (cdata_nz){
-        range = new MemoryRange(cdata, border_hi, 4, "cdata");
-        ret += memory.registerMemoryRange(range);
+        sections.push_back(SectionDesc<Addr>("cdata", cdata, border_hi, 4));
         border_hi = cdata - 1;
     }
 
     // code section
-    range = new MemoryRange(4, border_hi, 5, "code");
-    ret += memory.registerMemoryRange(range);
+    sections.push_back(SectionDesc<Addr>("code", 4, border_hi, 5));
     border_hi = 3;
 
     // reserved first segment
-    range = new MemoryRange(0, border_hi, 0, "reserved");
-    ret += memory.registerMemoryRange(range);
+    sections.push_back(SectionDesc<Addr>("reserved", 0, border_hi, 0));
+    return 0;
+}
 
+/*
+ * Create the memory regions of the layout and add them to the memory map
+ */
+template <typename Addr>
+int mapLayout(Memory<Addr>& memory, const ImageLayout<Addr>& layout){
+    int ret = 0;
+    for (auto it = layout.sections.begin(); it != layout.sections.end(); ++it)
+        ret += memory.registerMemoryRange(newMemoryRange<Addr>(it->start, it->end, it->mode, it->name));
     if (ret){
-        std::cout << "There were errors while registering memory regions" << std::endl;
-        infile.close();
+        simOut() << "There were errors while registering memory regions" << std::endl;
         return 1;
     }
+    return 0;
+}
 
-
-    // fill the memory with pre-defined data from the file
-    ret = 0;
+/*
+ * Fill the memory with pre-defined data from the file, it's right after the loader fields
+ */
+template <typename Addr>
+int loadSections(std::ifstream& infile, Memory<Addr>& memory, const ImageLayout<Addr>& layout){
+    char byte;
+    uint32_t index = 0;
+    int ret = 0;
 
     // code section
-    ret = loadMemoryRange(infile, memory, "code", code_sz);
+    ret = loadMemoryRange(infile, memory, "code", layout.code_sz);
     if (ret){
-        if (ret == 2) std::cout << "Insufficient data in the file, code section" << std::endl;
-        else          std::cout << "Cannot locate previously registered memory range 'code'" << std::endl;
-        infile.close();
+        if (ret == 2) simOut() << "Insufficient data in the file, code section" << std::endl;
+        else          simOut() << "Cannot locate previously registered memory range 'code'" << std::endl;
         return 1;
     }
     // cdata section
-    if (cdata_nz)
-        ret = loadMemoryRange(infile, memory, "cdata", cdata_sz);
+    if (layout.cdata)
+        ret = loadMemoryRange(infile, memory, "cdata", layout.cdata_sz);
     else
         ret = 0;
     if (ret){
-        if (ret == 2) std::cout << "Insufficient data in the file, cdata section" << std::endl;
-        else          std::cout << "Cannot locate previously registered memory range 'cdata'" << std::endl;
-        infile.close();
+        if (ret == 2) simOut() << "Insufficient data in the file, cdata section" << std::endl;
+        else          simOut() << "Cannot locate previously registered memory range 'cdata'" << std::endl;
         return 1;
     }
     // data section
-    if (data_nz)
-        ret = loadMemoryRange(infile, memory, "data", data_sz);
+    if (layout.data)
+        ret = loadMemoryRange(infile, memory, "data", layout.data_sz);
     else
         ret = 0;
     if (ret){
-        if (ret == 2) std::cout << "Insufficient data in the file, data section" << std::endl;
-        else          std::cout << "Cannot locate previously registered memory range 'data'" << std::endl;
-        infile.close();
+        if (ret == 2) simOut() << "Insufficient data in the file, data section" << std::endl;
+        else          simOut() << "Cannot locate previously registered memory range 'data'" << std::endl;
         return 1;
     }
     // dbg section
     index = 0;
-    while (index < dbg_sz){
+    while (index < layout.dbg_sz){
         if (infile.get(byte)) index++;
         else                  break;
     }
-    if (dbg_sz != index){
-        std::cout << "Insufficient data in the file, dbg section" << std::endl;
-        infile.close();
+    if (layout.dbg_sz != index){
+        simOut() << "Insufficient data in the file, dbg section" << std::endl;
         return 1;
     }
 
     if (infile.get(byte)){
-        std::cout << "Excessive data in the file" << std::endl;
-        infile.close();
+        simOut() << "Excessive data in the file" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Parse the given binary file and fill the simulator data classes accordingly
+ * The layout of the image is returned too, its code_sz is all the verifier may rely on
+ */
+template <typename Addr>
+int parseInput(Memory<Addr>& memory, ImageLayout<Addr>& layout, bool DEBUG){
+    std::ifstream infile("input", std::ios::binary);
+    if (readLayout(infile, layout, DEBUG) || mapLayout(memory, layout) || loadSections(infile, memory, layout))
+        return 1;
+    return 0;
+}
+
+/*
+ * Toy3 image: a section table instead of the fixed loader fields, any number of named sections
+ * anywhere below the i/o range. Big-endian fields, A is the address (and word) size
+ *
+ *   "Toy3"                         4 bytes
+ *   width                          1 byte, A: 2 or 4
+ *   sections count                 2 bytes
+ *   for every section:
+ *     name length, name            1 byte + name length bytes
+ *     start, end                   A + A bytes, the memory range, inclusive
+ *     mode                         1 byte: readable, writeable, executable bits, as in the loader
+ *     encoding                     1 byte: 0 - raw, 1 - PackBits RLE
+ *     data offset, stored size     4 + 4 bytes, the section data in the file
+ *     size                         A bytes, decoded data size, it's loaded at the section start
+ *   section data
+ *
+ * The code section ("code") starts at 0x4, its size is code_sz of Toy1/Toy2
+ */
+template <typename Addr>
+class TableEntry{
+    public:
+        uint8_t encoding;
+        uint64_t offset;
+        uint64_t stored;
+        uint64_t size;
+
+        TableEntry(uint8_t encoding, uint64_t offset, uint64_t stored, uint64_t size) :
+            encoding(encoding),
+            offset(offset),
+            stored(stored),
+            size(size)
+            {};
+
+        ~TableEntry() {};
+};
+
+/*
+ * Read the section table of a Toy3 image and validate it, the entries go in the order of layout.sections
+ * (the i/o range goes first, with no data)
+ */
+template <typename Addr>
+int readTable(const std::string& input, ImageLayout<Addr>& layout, std::vector<TableEntry<Addr> >& entries, bool DEBUG){
+    const uint8_t A = sizeof(Addr);
+    const uint8_t *data = (const uint8_t*)input.data();
+    size_t pos = 4;
+    uint64_t width = 0;
+    uint64_t count = 0;
+    int ret = 0;
+
+    ret += getField(data, input.size(), pos, width, 1);
+    if (input.compare(0, 4, "Toy3") || ret || width != A){
+        simOut() << "Wrong input file format" << std::endl;
+        return 1;
+    }
+    layout.header = "Toy3";
+    std::vector<SectionDesc<Addr> >& sections = layout.sections;
+    sections.clear();
+    entries.clear();
+    sections.push_back(SectionDesc<Addr>("i/o", AddressSpace<Addr>::io_base, AddressSpace<Addr>::last, 8));
+    entries.push_back(TableEntry<Addr>(0, 0, 0, 0));
+
+    ret += getField(data, input.size(), pos, count, 2);
+    for (uint64_t i = 0; i < count && !ret; i++){
+        uint64_t name_len = 0;
+        uint64_t start = 0;
+        uint64_t end = 0;
+        uint64_t mode = 0;
+        uint64_t encoding = 0;
+        uint64_t offset = 0;
+        uint64_t stored = 0;
+        uint64_t size = 0;
+        ret += getField(data, input.size(), pos, name_len, 1);
+        if (ret || pos + name_len > input.size()){
+            ret = 1;
+            break;
+        }
+        std::string name = input.substr(pos, name_len);
+        pos += name_len;
+        ret += getField(data, input.size(), pos, start, A);
+        ret += getField(data, input.size(), pos, end, A);
+        ret += getField(data, input.size(), pos, mode, 1);
+        ret += getField(data, input.size(), pos, encoding, 1);
+        ret += getField(data, input.size(), pos, offset, 4);
+        ret += getField(data, input.size(), pos, stored, 4);
+        ret += getField(data, input.size(), pos, size, A);
+        sections.push_back(SectionDesc<Addr>(name, (Addr)start, (Addr)end, (uint8_t)mode));
+        entries.push_back(TableEntry<Addr>((uint8_t)encoding, offset, stored, size));
+        if (name == "code")
+            layout.code_sz = (Addr)size;
+    }
+    if (ret){
+        simOut() << "Section table cannot be read" << std::endl;
         return 1;
     }
 
-    infile.close();
-    return 0;    
+    if (DEBUG)
+        printLayout(layout);
+
+    // every section on its own, then all of them together
+    for (size_t i = 1; i < sections.size(); i++){
+        const SectionDesc<Addr>& section = sections[i];
+        const TableEntry<Addr>& entry = entries[i];
+        std::string error;
+        if (section.name.empty() || section.name == "i/o")
+            error = "the name is reserved";
+        else if (std::count_if(sections.begin(), sections.end(),
+                               [&section](const SectionDesc<Addr>& other){return other.name == section.name;}) > 1)
+            error = "the name is used more than once";
+        else if (section.start > section.end)
+            error = "start is more than end";
+        else if (section.mode > 7)
+            error = "wrong mode";
+        else if (entry.encoding > 1)
+            error = "unknown encoding";
+        else if (entry.size > (uint64_t)section.end - section.start + 1)
+            error = "size is more than the actual section size";
+        else if (entry.encoding == 0 && entry.stored != entry.size)
+            error = "stored size of raw data is not its size";
+        else if (entry.offset < pos || entry.offset + entry.stored > input.size())
+            error = "data is out of the file";
+        if (!error.empty()){
+            simOut() << "Section '" << section.name << "': " << error << std::endl;
+            return 1;
+        }
+    }
+    std::vector<const SectionDesc<Addr>*> ordered;
+    for (auto it = sections.begin(); it != sections.end(); ++it)
+        ordered.push_back(&*it);
+    std::sort(ordered.begin(), ordered.end(),
+              [](const SectionDesc<Addr>* a, const SectionDesc<Addr>* b){return a->start < b->start;});
+    for (size_t i = 1; i < ordered.size(); i++){
+        if (ordered[i]->start <= ordered[i - 1]->end){
+            simOut() << "Sections '" << ordered[i - 1]->name << "' and '" << ordered[i]->name << "' overlap" << std::endl;
+            return 1;
+        }
+    }
+
+    auto code = std::find_if(sections.begin(), sections.end(), [](const SectionDesc<Addr>& section){return section.name == "code";});
+    if (code == sections.end()){
+        simOut() << "There is no code section" << std::endl;
+        return 1;
+    }
+    // execution starts at 0x4
+    if (code->start != 4){
+        simOut() << "code section shall start at 0x4" << std::endl;
+        return 1;
+    }
+    if (layout.code_sz == 0){
+        simOut() << "code_sz cannot be zero" << std::endl;
+        return 1;
+    }
+    if (layout.code_sz % 4){
+        simOut() << "code_sz shall be 4-bytes aligned" << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
-int runSimulation(Memory& mem, bool LOG_EN){
+/*
+ * Write the section data to the start of the range. PackBits RLE: a control byte c < 0x80 is followed
+ * by c + 1 literal bytes, c > 0x80 - by a byte repeated 257 - c times, c = 0x80 is skipped.
+ * Returns 1 if the data doesn't decode to exactly the section size
+ */
+template <typename Addr>
+int decodeSection(MemoryRange<Addr>* range, const uint8_t *data, const TableEntry<Addr>& entry){
+    Addr addr = range->getStart();
+    if (entry.encoding == 0){
+        range->writeBlock(addr, data, entry.size);
+        return 0;
+    }
+    uint64_t left = entry.size;
+    size_t pos = 0;
+    while (pos < entry.stored){
+        uint8_t control = data[pos++];
+        if (control == 0x80)
+            continue;
+        size_t n = control < 0x80 ? control + 1 : 257 - control;
+        // the literal bytes or the repeated one
+        size_t operand = control < 0x80 ? n : 1;
+        if (n > left || pos + operand > entry.stored)
+            return 1;
+        if (control < 0x80)
+            range->writeBlock(addr, data + pos, n);
+        else
+            range->fillBlock(addr, data[pos], n);
+        pos += operand;
+        addr += n;
+        left -= n;
+    }
+    return left != 0;
+}
+
+/*
+ * Populate the ranges of the sections from the image data. The sections are independent,
+ * they are decoded in parallel, a section per worker at a time
+ */
+template <typename Addr>
+int populateSections(const std::string& input, Memory<Addr>& memory, const ImageLayout<Addr>& layout,
+                     const std::vector<TableEntry<Addr> >& entries){
+    std::vector<MemoryRange<Addr>*> ranges;
+    for (auto it = layout.sections.begin(); it != layout.sections.end(); ++it)
+        ranges.push_back(memory.getRangeByName(it->name));
+    std::vector<int> failed(entries.size(), 0);
+    std::atomic<size_t> next(0);
+    size_t workers = std::min<size_t>(entries.size(), std::max(1U, std::thread::hardware_concurrency()));
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; i++){
+        threads.emplace_back([&](){
+            for (size_t j = next++; j < entries.size(); j = next++)
+                failed[j] = decodeSection(ranges[j], (const uint8_t*)input.data() + entries[j].offset, entries[j]);
+        });
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
     int ret = 0;
-    Core core = Core(0x4, LOG_EN);
-    core.bindMemory(&mem);
+    for (size_t i = 0; i < entries.size(); i++){
+        if (failed[i]){
+            simOut() << "Section '" << layout.sections[i].name << "': data is corrupted" << std::endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Parse the Toy3 image (the whole input file content), the table is validated before any range is populated
+ */
+template <typename Addr>
+int parseTable(Memory<Addr>& memory, ImageLayout<Addr>& layout, const std::string& input, bool DEBUG){
+    std::vector<TableEntry<Addr> > entries;
+    if (readTable(input, layout, entries, DEBUG) || mapLayout(memory, layout) || populateSections(input, memory, layout, entries))
+        return 1;
+    return 0;
+}
+
+/*
+ * Print the verifier problems (each one tied to an instruction address) in the debug mode,
+ * returns their number. Otherwise the fallback to the checked execution is silent
+ */
+template <typename Addr>
+int reportVerifier(const VerifierReport<Addr>& report, bool DEBUG){
+    if (!DEBUG)
+        return report.problems.size();
+    for (auto it = report.problems.begin(); it != report.problems.end(); ++it)
+        simOut() << "Verifier: 0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << it->first
+                 << ": " << it->second << std::endl;
+    if (report.problems.empty())
+        simOut() << "Verifier: " << std::dec << report.verified.size() << " instructions verified" << std::endl;
+    else
+        simOut() << "Verifier found problems, falling back to checked execution" << std::endl;
+    return report.problems.size();
+}
 
-    // execute a code from the entry point (0x4)
+/*
+ * Load-time static analysis of the code section, everything that can be proven once is checked here:
+ * opcodes, CMP condition codes, static branch targets and the code range permissions.
+ * The section is never written (no write permission), so on success its words are copied to the report
+ * and the core may fetch them with no per-instruction checks. Returns the number of found problems.
+ * Nothing is printed, see reportVerifier
+ * Register-indirect branches and smc code cannot be proven, they stay on the checked path
+ */
+template <typename Addr>
+int verifyCode(Memory<Addr>& memory, Addr code_sz, VerifierReport<Addr>& report){
+    uint32_t instr = 0;
+    std::vector<uint32_t>& verified = report.verified;
+    std::vector<std::pair<Addr, std::string> >& problems = report.problems;
+
+    verified.clear();
+    problems.clear();
+    MemoryRange<Addr>* code = memory.getRangeByName("code");
+    if (code == nullptr){
+        problems.push_back(std::make_pair((Addr)0, "cannot locate memory range 'code'"));
+        return 1;
+    }
+    Addr start = code->getStart();
+    Addr end = start + code_sz;
+    // readable and executable, but not writeable
+    if ((code->getMode() & 0x7) != 0x5){
+        problems.push_back(std::make_pair(start, "code range is expected to be read and execute only"));
+    }
+
+    MemoryTransaction<Addr> req = MemoryTransaction<Addr>(start, &instr, 4, 1, 0);
+    for (uint64_t addr = start; addr < end; addr += 4){
+        req.addr = addr;
+        code->directAccess(&req);
+
+        uint8_t opc = (uint8_t)(instr >> 28);
+        uint8_t rd_index = (uint8_t)((instr >> 24) & 0xf);
+        uint8_t rs1_index = (uint8_t)((instr >> 20) & 0xf);
+        uint8_t rs2_index = (uint8_t)((instr >> 16) & 0xf);
+        uint16_t imm = (uint16_t)(instr & 0xffff);
+
+        if (opc == 0xf && rd_index + ((imm >> 11) & 0xf) + 1 > 16){
+            std::stringstream msg;
+            msg << "LDM/STM register range r" << std::dec << (uint32_t)rd_index << "-r" << rd_index + ((imm >> 11) & 0xf)
+                << " is out of the register file";
+            problems.push_back(std::make_pair((Addr)addr, msg.str()));
+        }
+        if (opc == 0xb && imm > 0xb){
+            std::stringstream msg;
+            msg << "invalid CMP condition code 0x" << std::hex << imm;
+            problems.push_back(std::make_pair((Addr)addr, msg.str()));
+        }
+        // r0 is always zero, so the jump destination is known only for rs2 = r0
+        if (opc == 0xc && rs2_index == 0 && !(imm & 0x3)){
+            MemoryRange<Addr>* target = memory.getRangeByAddr(imm);
+            bool in_code = imm >= start && imm < end;
+            // branches to other executable ranges (smc) are legal, but they are not proven
+            bool in_other = target != nullptr && target != code && (target->getMode() & 0x1);
+            if (!in_code && !in_other){
+                std::stringstream msg;
+                msg << "branch target 0x" << std::setfill('0') << std::setw(AddressSpace<Addr>::digits) << std::hex << imm
+                    << " is outside the code section";
+                problems.push_back(std::make_pair((Addr)addr, msg.str()));
+            }
+        }
+        // the last instruction must not let the execution fall through to the unloaded code
+        if (addr + 4 == end && !(opc == 0xc && rs1_index == 0)){
+            problems.push_back(std::make_pair((Addr)addr, "execution falls through past the end of the code section"));
+        }
+        verified.push_back(instr);
+    }
+
+    if (!problems.empty())
+        verified.clear();
+    return problems.size();
+}
+
+/*
+ * Load the image, from the cache if it's been loaded before: the image is neither parsed nor verified then,
+ * its pages are read on the first access. 'dir' is the cache directory, empty for none, 'keep' tells
+ * the image is loaded again by the next instances. The image that can't be reused is not cached
+ */
+template <typename Addr>
+int loadImage(Memory<Addr>& memory, std::shared_ptr<const CachedImage<Addr> >& image, const std::string& dir, bool keep, bool DEBUG){
+    bool reuse = keep || !dir.empty();
+    std::ifstream infile("input", std::ios::binary | std::ios::ate);
+    std::streamoff file_size = infile ? (std::streamoff)infile.tellg() : 0;
+    char header[4] = {0};
+    infile.seekg(0);
+    infile.read(header, 4);
+    bool table = std::string(header, 4) == "Toy3";
+
+    // the whole file is read at once if it's needed, the cached image refers to the same buffer.
+    // Toy1 and Toy2 loaders read the file by themselves
+    std::shared_ptr<std::string> input = std::make_shared<std::string>();
+    if (reuse || table){
+        input->resize(file_size > 0 ? file_size : 0);
+        infile.seekg(0);
+        infile.read(&(*input)[0], input->size());
+    }
+    uint64_t hash = 0;
+    if (reuse){
+        hash = fnv1a64((const uint8_t*)input->data(), input->size());
+        image = ImageCache<Addr>::instance().find(hash, *input, dir);
+        if (image != nullptr){
+            if (DEBUG)
+                printLayout(image->layout);
+            if (mapLayout(memory, image->layout))
+                return 1;
+            image->attachPages(memory);
+            return 0;
+        }
+    }
+
+    ImageLayout<Addr> layout;
+    VerifierReport<Addr> report;
+    if (table ? parseTable(memory, layout, *input, DEBUG) : parseInput(memory, layout, DEBUG))
+        return 1;
+    verifyCode(memory, layout.code_sz, report);
+    if (!reuse){
+        image = ImageCache<Addr>::uncached(layout, report);
+        return 0;
+    }
+    image = ImageCache<Addr>::instance().add(hash, input, layout, memory, report, dir, keep);
+    return 0;
+}
+
+/*
+ * Print the watchpoint hit report, the register file is printed by the caller.
+ * If a snapshot file is given, the state at the hit is saved there as a checkpoint
+ */
+template <typename Addr, typename Word>
+int reportWatchHit(Memory<Addr>& mem, Core<Addr, Word>& core, const std::string& snapshot, Addr code_sz){
+    const WatchHit<Addr>& hit = mem.getWatchHit();
+    const int digits = AddressSpace<Addr>::digits;
+    if (hit.kind == WATCH_EXEC){
+        // the instruction is not executed, get back to it (the counters too) so that the snapshot resumes right from it
+        core.unfetch();
+        simOut() << "Breakpoint hit: ip=0x" << std::setfill('0') << std::setw(digits) << std::hex << hit.addr << std::endl;
+    }
+    else{
+        // the accessing instruction is the fetched one, ip may have been changed by it
+        simOut() << "Watchpoint hit: ip=0x" << std::setfill('0') << std::setw(digits) << std::hex << core.getFetchedIp()
+                  << ", " << (hit.kind == WATCH_WRITE ? "write" : "read")
+                  << " [0x" << std::setfill('0') << std::setw(digits) << std::hex << hit.addr << "]"
+                  << ", old=0x" << std::setfill('0') << std::setw(hit.size * 2) << std::hex << hit.old_value
+                  << ", new=0x" << std::setfill('0') << std::setw(hit.size * 2) << std::hex << hit.new_value << std::endl;
+    }
+    if (!snapshot.empty()){
+        if (writeCheckpoint<Addr, Word>(snapshot, core, mem, code_sz))
+            simOut() << "Snapshot cannot be saved" << std::endl;
+        else
+            simOut() << "Snapshot saved to " << snapshot << std::endl;
+    }
+    return 4;
+}
+
+template <typename Addr, typename Word>
+int runSimulation(Memory<Addr>& mem, Core<Addr, Word>& core, const std::vector<uint32_t>* verified,
+                  Checkpointer& ckpt, const std::string& snapshot, Addr code_sz, bool LOG_EN){
+    int ret = 0;
+    if (verified != nullptr)
+        core.bindVerifiedCode(mem.getRangeByName("code")->getStart(), verified);
+    IoRange<Addr>* io = dynamic_cast<IoRange<Addr>*>(mem.getRangeByName("i/o"));
+
+    // execute a code from the entry point (0x4) or from the restored ip
     while (1){
         if (LOG_EN){
-            std::cout << "-----" << std::endl;
+            simOut() << "-----" << std::endl;
         }
         try{
+            // device events due by now update the i/o registers before the next instruction
+            if (io != nullptr && core.getCycles() >= io->nextEventTime())
+                io->advance(core.getCycles());
             core.fetch();
-            ret=core.execute();
+            // a breakpoint stops the run before the instruction is executed
+            if (!mem.hasWatchHit())
+                ret=core.execute();
         }
         catch (const std::domain_error& ex){
-            std::cout << "Memory access error: " << ex.what() << std::endl;
+            simOut() << "Memory access error: " << ex.what() << std::endl;
+            ret = 3;
+        }
+        // an access outside of the ranges (a LDM/STM block crossing a range end too) is the guest fault as well
+        catch (const std::out_of_range& ex){
+            simOut() << "Memory access error: " << ex.what() << std::endl;
             ret = 3;
         }
+        if (!ret && mem.hasWatchHit())
+            ret = reportWatchHit(mem, core, snapshot, code_sz);
         if (ret){
             if (ret == 2){
-                std::cout << "Wrong instruction opcode" << std::endl;
+                simOut() << "Wrong instruction opcode" << std::endl;
             }
             if (ret == 1){
                 // got HALT, the only good simulation finish condition
-                std::cout << "Got HALT, finishing simulation" << std::endl;
+                simOut() << "Got HALT, finishing simulation" << std::endl;
+            }
+            else if (ret == 4){
+                simOut() << "Simulation stopped at a watchpoint" << std::endl;
             }
             else{
-                std::cout << "Simulation terminated due to errors" << std::endl;
+                simOut() << "Simulation terminated due to errors" << std::endl;
             }
             break;
         }
+        if (ckpt.due(core.getInstrCount()) && ckpt.take<Addr, Word>(core, mem, code_sz))
+            simOut() << "Checkpoint failed, simulation goes on" << std::endl;
     }
     core.printRegFile();
 
@@ -369,18 +837,257 @@ bool checkForOption(char **start, char **end, const std::string &option){
 
 }
 
-int main(int argc, char *argv[]){
+/*
+ * Get the argument following an option, e.g. "resume <file>", empty if there's none
+ */
+std::string getOptionValue(char **start, char **end, const std::string &option){
+    char **it = std::find(start, end, option);
+    if (it == end || it + 1 == end)
+        return "";
+    return *(it + 1);
+}
+
+/*
+ * Same as getOptionValue, but for the options that can be given multiple times
+ */
+std::vector<std::string> getOptionValues(char **start, char **end, const std::string &option){
+    std::vector<std::string> values;
+    for (char **it = std::find(start, end, option); it != end && it + 1 != end; it = std::find(it + 1, end, option))
+        values.push_back(*(it + 1));
+    return values;
+}
+
+/*
+ * Set up watchpoints of the given kind from "<addr>" or "<lo>:<hi>" arguments
+ */
+template <typename Addr>
+int addWatchpoints(Memory<Addr>& mem, const std::vector<std::string>& args, uint8_t kind){
+    for (auto it = args.begin(); it != args.end(); ++it){
+        char *rest = nullptr;
+        unsigned long long lo = std::strtoull(it->c_str(), &rest, 0);
+        unsigned long long hi = lo;
+        if (*rest == ':')
+            hi = std::strtoull(rest + 1, &rest, 0);
+        if (*rest != '\0' || it->empty() || lo > hi || hi > AddressSpace<Addr>::last){
+            simOut() << "Wrong watchpoint address range " << *it << std::endl;
+            return 1;
+        }
+        mem.addWatchpoint((Addr)lo, (Addr)hi, kind);
+    }
+    return 0;
+}
+
+/*
+ * Queue device events given as "<cycle>:<addr>:<value>" arguments, the events of the same cycle
+ * fire in the order they are given
+ */
+template <typename Addr, typename Word>
+int scheduleIoEvents(Memory<Addr>& mem, const std::vector<std::string>& args){
+    IoRange<Addr>* io = dynamic_cast<IoRange<Addr>*>(mem.getRangeByName("i/o"));
+    for (auto it = args.begin(); it != args.end(); ++it){
+        char *rest = nullptr;
+        uint64_t time = std::strtoull(it->c_str(), &rest, 0);
+        unsigned long long addr = *rest == ':' ? std::strtoull(rest + 1, &rest, 0) : 0;
+        unsigned long long value = *rest == ':' ? std::strtoull(rest + 1, &rest, 0) : ~0ULL;
+        if (io == nullptr || *rest != '\0' || addr < io->getStart() || addr + sizeof(Word) - 1 > io->getEnd()
+            || value > (Word)~(Word)0){
+            simOut() << "Wrong i/o event " << *it << std::endl;
+            return 1;
+        }
+        io->scheduleEvent(IoEvent<Addr>(time, (Addr)addr, (uint32_t)value, sizeof(Word)));
+    }
+    return 0;
+}
+
+/*
+ * A simulated machine, several of them can run at once on the same image, each one with its own output
+ */
+template <typename Addr, typename Word>
+class Instance{
+    public:
+        // goes first, the memory and the core may be using it till their end
+        ShmSegment<Addr, Word> shm;
+        Memory<Addr> mem;
+        Core<Addr, Word> core;
+        Addr code_sz;
+        // the loaded image, the instances of the same image share it
+        std::shared_ptr<const CachedImage<Addr> > image;
+        // verifier results of a resumed instance
+        VerifierReport<Addr> report;
+        // the verified code the core runs, the same code of another instance is not kept twice
+        const std::vector<uint32_t>* code;
+        // checkpoint, snapshot and shared memory segment names suffix, empty for a single instance
+        std::string suffix;
+        std::stringstream out;
+
+        Instance(bool log_en) : shm(), mem(), core(0x4, log_en), code_sz(0), code(nullptr) {core.bindMemory(&mem);};
+
+        ~Instance() {};
+};
+
+/*
+ * Load the image (or the checkpoint) and set up the instance for a run.
+ * first_code is the verified code of the first instance, if any
+ */
+template <typename Addr, typename Word>
+int prepareInstance(Instance<Addr, Word>& inst, int argc, char *argv[], const std::vector<uint32_t>* first_code){
     bool DEBUG = checkForOption(argv, argv + argc, "debug");
-    bool LOG_EN = checkForOption(argv, argv + argc, "log");
+    bool CHECKED = checkForOption(argv, argv + argc, "checked");
+    bool NOIDLE = checkForOption(argv, argv + argc, "noidle");
+    bool NODMA = checkForOption(argv, argv + argc, "nodma");
+    std::string RESUME = getOptionValue(argv, argv + argc, "resume");
+    std::string CACHE = getOptionValue(argv, argv + argc, "cache");
+    // the image is loaded again by the next instances
+    bool KEEP = std::strtoul(getOptionValue(argv, argv + argc, "instances").c_str(), nullptr, 0) > 1;
+    Memory<Addr>& mem = inst.mem;
 
-    Memory mem = Memory();
-    if (parseInput(mem, DEBUG)){
-        std::cout << "There were errors during preparation process, simulation aborted" << std::endl;
+    if (!RESUME.empty()){
+        if (readCheckpoint<Addr, Word>(RESUME, inst.core, mem, inst.code_sz)){
+            simOut() << "Cannot resume from " << RESUME << ", simulation aborted" << std::endl;
+            return 1;
+        }
+    }
+    else if (loadImage(mem, inst.image, CACHE, KEEP, DEBUG)){
+        simOut() << "There were errors during preparation process, simulation aborted" << std::endl;
         return 1;
     }
-    runSimulation(mem, LOG_EN);
+    else{
+        inst.code_sz = inst.image->layout.code_sz;
+    }
+    int ret = 0;
+    ret += addWatchpoints(mem, getOptionValues(argv, argv + argc, "break"), WATCH_EXEC);
+    ret += addWatchpoints(mem, getOptionValues(argv, argv + argc, "watch"), WATCH_READ | WATCH_WRITE);
+    ret += addWatchpoints(mem, getOptionValues(argv, argv + argc, "rwatch"), WATCH_READ);
+    ret += addWatchpoints(mem, getOptionValues(argv, argv + argc, "wwatch"), WATCH_WRITE);
+    // the pending events of a resumed simulation come from the checkpoint, the given ones are there already
+    if (RESUME.empty())
+        ret += scheduleIoEvents<Addr, Word>(mem, getOptionValues(argv, argv + argc, "ioevent"));
+    if (ret){
+        simOut() << "Simulation aborted" << std::endl;
+        return 1;
+    }
+    // the programs that pass the verifier run with no redundant per-instruction checks,
+    // the loaded images have been verified by the loader
+    if (!CHECKED){
+        if (inst.image == nullptr)
+            verifyCode(mem, inst.code_sz, inst.report);
+        const VerifierReport<Addr>& report = inst.image == nullptr ? inst.report : inst.image->report;
+        reportVerifier(report, DEBUG);
+        if (first_code != nullptr && report.verified == *first_code){
+            std::vector<uint32_t>().swap(inst.report.verified);
+            inst.code = first_code;
+        }
+        else if (!report.verified.empty()){
+            inst.code = &report.verified;
+        }
+    }
+    IoRange<Addr>* io = dynamic_cast<IoRange<Addr>*>(mem.getRangeByName("i/o"));
+    if (io != nullptr && !NODMA)
+        io->bindDma(&mem, sizeof(Word));
+    if (!NOIDLE)
+        inst.core.bindIo(io);
+    return 0;
+}
+
+template <typename Addr, typename Word>
+void runInstance(Instance<Addr, Word>& inst, int argc, char *argv[]){
+    bool DEBUG = checkForOption(argv, argv + argc, "debug");
+    bool LOG_EN = checkForOption(argv, argv + argc, "log");
+    std::string CKPT_FILE = getOptionValue(argv, argv + argc, "checkpoint");
+    uint64_t CKPT_INSTR = std::strtoull(getOptionValue(argv, argv + argc, "ckpt_instr").c_str(), nullptr, 0);
+    uint32_t CKPT_SEC = std::strtoul(getOptionValue(argv, argv + argc, "ckpt_sec").c_str(), nullptr, 0);
+    std::string SNAPSHOT = getOptionValue(argv, argv + argc, "snapshot");
+    // a checkpoint file with no trigger given is updated once a minute
+    if (!CKPT_INSTR && !CKPT_SEC)
+        CKPT_SEC = 60;
+    if (!CKPT_FILE.empty())
+        CKPT_FILE += inst.suffix;
+    if (!SNAPSHOT.empty())
+        SNAPSHOT += inst.suffix;
+
+    Checkpointer ckpt = Checkpointer(CKPT_FILE, CKPT_INSTR, CKPT_SEC, inst.core.getInstrCount());
+    runSimulation(inst.mem, inst.core, inst.code, ckpt, SNAPSHOT, inst.code_sz, LOG_EN);
     if (DEBUG)
-        mem.memoryDump();
+        inst.mem.memoryDump();
+}
 
-    return 0;
+/*
+ * Prepare and run the simulation of the machine with the given address and word types.
+ * "instances <n>" runs n instances of the image at once, one per thread, their read-only pages are shared
+ * and the output of every instance is printed once all of them are done.
+ * "shm <name>" keeps the memory and the registers of an instance in a shared memory segment for live monitoring
+ */
+template <typename Addr, typename Word>
+int simulate(int argc, char *argv[]){
+    bool LOG_EN = checkForOption(argv, argv + argc, "log");
+    bool DEBUG = checkForOption(argv, argv + argc, "debug");
+    uint32_t INSTANCES = std::strtoul(getOptionValue(argv, argv + argc, "instances").c_str(), nullptr, 0);
+    std::string SHM = getOptionValue(argv, argv + argc, "shm");
+    if (!INSTANCES)
+        INSTANCES = 1;
+
+    std::vector<std::unique_ptr<Instance<Addr, Word> > > instances;
+    int ret = 0;
+    for (uint32_t i = 0; i < INSTANCES && !ret; i++){
+        instances.emplace_back(new Instance<Addr, Word>(LOG_EN));
+        Instance<Addr, Word>& inst = *instances.back();
+        if (INSTANCES > 1){
+            setSimOut(&inst.out);
+            inst.suffix = "." + std::to_string(i);
+        }
+        ret = prepareInstance(inst, argc, argv, i ? instances[0]->code : nullptr);
+        if (ret)
+            break;
+        // a segment has its own copy of every page
+        if (!SHM.empty())
+            ret = inst.shm.create(SHM + inst.suffix, inst.mem, inst.core);
+        else if (INSTANCES > 1)
+            inst.mem.shareReadOnlyPages();
+    }
+    setSimOut(nullptr);
+
+    if (!ret && INSTANCES == 1){
+        runInstance(*instances[0], argc, argv);
+    }
+    else if (!ret){
+        std::vector<std::thread> threads;
+        for (auto it = instances.begin(); it != instances.end(); ++it){
+            Instance<Addr, Word>* inst = it->get();
+            threads.emplace_back([inst, argc, argv](){
+                setSimOut(&inst->out);
+                runInstance(*inst, argc, argv);
+            });
+        }
+        for (auto it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+    }
+    if (INSTANCES > 1){
+        for (size_t i = 0; i < instances.size(); i++)
+            std::cout << "=== instance " << std::dec << i << " ===" << std::endl << instances[i]->out.str();
+        if (DEBUG)
+            std::cout << "Shared pages: " << std::dec << SharedPagePool::instance().size() << std::endl;
+    }
+    return ret;
 }
+
+/*
+ * Image (or checkpoint) address width in bytes, the input file header tells the machine to simulate
+ */
+int inputWidth(const std::string& resume){
+    if (!resume.empty())
+        return checkpointWidth(resume);
+    char header[5] = {0};
+    std::ifstream infile("input", std::ios::binary);
+    infile.read(header, 4);
+    // Toy3 images give the width explicitly
+    if (std::string(header) == "Toy3")
+        return infile.get() == 4 ? 4 : 2;
+    return std::string(header) == imageHeader<uint32_t>() ? 4 : 2;
+}
+
+int main(int argc, char *argv[]){
+    if (inputWidth(getOptionValue(argv, argv + argc, "resume")) == 4)
+        return simulate<uint32_t, uint32_t>(argc, argv);
+    return simulate<uint16_t, uint16_t>(argc, argv);
+}
+
@@ -1,10 +1,14 @@
 #ifndef SIMUL_H
 #define SIMUL_H
+template <typename Addr>
 class MemoryTransaction;
 
+template <typename Addr>
 class MemoryRange;
 
+template <typename Addr>
 class Memory;
 
+template <typename Addr, typename Word>
 class Core;
 #endif
@@ -1,7 +1,9 @@
 import sys
 outf = open(sys.argv[3], 'ab')
 
-if sys.argv[1] == 'size':
+# 'size' writes the code size field of a Toy1 image, 'size32' - of a Toy2 one
+if sys.argv[1] in ('size', 'size32'):
+    width = 4 if sys.argv[1] == 'size32' else 2
     size = 0
     for line in open(sys.argv[2]):
         if line.strip() == '':
@@ -9,14 +11,14 @@ if sys.argv[1] == 'size':
         if line.strip()[0] == '#':
             continue
         size += 4
-    if size >= 2**16:
+    if size >= 2**(8*width):
         raise ValueError("Code size is too big")
-    ba = bytearray([size >> 8, size & 0xff])
+    ba = bytearray([(size >> (8*i)) & 0xff for i in reversed(range(width))])
     outf.write(ba)
     exit()
 
 
-opcodes = {'ADD': 0x0, 'SUB': 0x1, 'MUL': 0x2, 'MODU': 0x3, 'DIV': 0x4, 'DIVU': 0x5, 'ORNOT': 0x6, 'AND': 0x7, 'LSL': 0x8, 'LSR': 0x9, 'ASR': 0xa, 'CMP': 0xb, 'BRN': 0xc, 'LD': 0xd, 'ST': 0xe}
+opcodes = {'ADD': 0x0, 'SUB': 0x1, 'MUL': 0x2, 'MODU': 0x3, 'DIV': 0x4, 'DIVU': 0x5, 'ORNOT': 0x6, 'AND': 0x7, 'LSL': 0x8, 'LSR': 0x9, 'ASR': 0xa, 'CMP': 0xb, 'BRN': 0xc, 'LD': 0xd, 'ST': 0xe, 'LDM': 0xf, 'STM': 0xf}
 comps = {'EQ': 0x0, 'NE': 0x1, 'BN': 0x2, 'BS': 0x3, 'LS': 0x4, 'GT': 0x5, 'GE': 0x6, 'LE': 0x7, 'BL': 0x8, 'AB': 0x9, 'BE': 0xa, 'AE': 0xb}
 for line in open(sys.argv[2]):
     if line.strip() == '':
@@ -37,6 +39,13 @@ for line in open(sys.argv[2]):
 
     imm = comps[args[4]] if args[4] in comps else int(args[4],0)
 
+    # LDM/STM rd, rs1, rs2, offset, count - registers rd..rd+count-1 at rs1 + rs2 + offset
+    if args[0].upper() in ('LDM', 'STM'):
+        count = int(args[5], 0)
+        if imm >= 0x800 or not 1 <= count <= 16 or rd + count > 16:
+            raise ValueError("wrong LDM/STM offset or register count")
+        imm = (args[0].upper() == 'STM') << 15 | (count - 1) << 11 | imm
+
     #print opc, rd, rs1, rs2, imm
     ba = bytearray([opc << 4 | rd, rs1 << 4 | rs2, imm >> 8, imm & 0xff])
     #print 